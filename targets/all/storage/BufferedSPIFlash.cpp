@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/BufferedSPIFlash.cpp
+ */
+
+#include "BufferedSPIFlash.h"
+
+namespace storage
+{
+
+async(BufferedSPIFlash::Read, uint32_t addr, Buffer data)
+async_def()
+{
+    await(flash.Read, addr, data);
+
+    if (Overlaps(addr, data.Length()))
+    {
+        // overlay the buffered data, programming can only clear bits
+        uint32_t start = std::max(addr, pageAddr + dirtyStart);
+        uint32_t end = std::min(uint32_t(addr + data.Length()), pageAddr + dirtyEnd);
+        auto dst = (char*)data.Pointer() + (start - addr);
+        for (auto src = page + (start - pageAddr); start < end; start++)
+        {
+            *dst++ &= *src++;
+        }
+    }
+}
+async_end
+
+async(BufferedSPIFlash::ReadToRegister, uint32_t addr, volatile void* reg, size_t length)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    await(flash.ReadToRegister, addr, reg, length);
+}
+async_end
+
+async(BufferedSPIFlash::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    async_return(await(flash.ReadToPipe, pipe, addr, length, timeout));
+}
+async_end
+
+async(BufferedSPIFlash::Write, uint32_t addr, Span data)
+async_def(
+    size_t written, len;
+)
+{
+    while (f.written < data.Length())
+    {
+        while (flushing)
+        {
+            // the buffer is being programmed
+            async_yield();
+        }
+
+        f.len = std::min(flash.PageRemaining(addr + f.written), data.Length() - f.written);
+
+        if (flash.PageAddress(addr + f.written) != pageAddr)
+        {
+            if (f.len == PAGE_SIZE)
+            {
+                // whole pages don't need buffering, but must not overtake the buffered one
+                await(Flush);
+                await(flash.Write, addr + f.written, Span((const char*)data.Pointer() + f.written, f.len));
+                f.written += f.len;
+                continue;
+            }
+
+            await(Flush);
+            if (flushing)
+            {
+                // someone else started using the buffer
+                continue;
+            }
+            pageAddr = flash.PageAddress(addr + f.written);
+        }
+
+        {
+            uint32_t offset = (addr + f.written) - pageAddr;
+            auto src = (const char*)data.Pointer() + f.written;
+            for (size_t i = 0; i < f.len; i++)
+            {
+                page[offset + i] &= src[i];
+            }
+            dirtyStart = std::min(dirtyStart, uint16_t(offset));
+            dirtyEnd = std::max(dirtyEnd, uint16_t(offset + f.len));
+        }
+
+        f.written += f.len;
+    }
+}
+async_end
+
+async(BufferedSPIFlash::Flush)
+async_def()
+{
+    while (flushing)
+    {
+        async_yield();
+    }
+
+    if (dirtyStart < dirtyEnd)
+    {
+        // the buffer must not change while being programmed
+        flushing = true;
+        await(flash.Write, pageAddr + dirtyStart, Span(page + dirtyStart, dirtyEnd - dirtyStart));
+        flushing = false;
+    }
+
+    memset(page, 0xFF, sizeof(page));
+    dirtyStart = PAGE_SIZE;
+    dirtyEnd = 0;
+    async_return(true);
+}
+async_end
+
+async(BufferedSPIFlash::FlushOverlap, uint32_t addr, size_t length)
+async_def()
+{
+    if (Overlaps(addr, length))
+    {
+        await(Flush);
+    }
+}
+async_end
+
+void BufferedSPIFlash::Discard(uint32_t addr, size_t length)
+{
+    if (!flushing && pageAddr >= addr && pageAddr + PAGE_SIZE <= addr + length)
+    {
+        memset(page, 0xFF, sizeof(page));
+        dirtyStart = PAGE_SIZE;
+        dirtyEnd = 0;
+    }
+}
+
+async(BufferedSPIFlash::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    async_return(await(flash.WriteFromPipe, pipe, addr, length, timeout));
+}
+async_end
+
+async(BufferedSPIFlash::Fill, uint32_t addr, uint8_t value, size_t length)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    await(flash.Fill, addr, value, length);
+}
+async_end
+
+async(BufferedSPIFlash::IsAll, uint32_t addr, uint8_t value, size_t length)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    async_return(await(flash.IsAll, addr, value, length));
+}
+async_end
+
+async(BufferedSPIFlash::Erase, uint32_t addr, uint32_t length)
+async_def()
+{
+    Discard(addr, length);
+    await(FlushOverlap, addr, length);
+    await(flash.Erase, addr, length);
+}
+async_end
+
+async(BufferedSPIFlash::EraseFirst, uint32_t addr, uint32_t length)
+async_def()
+{
+    await(FlushOverlap, addr, length);
+    async_return(await(flash.EraseFirst, addr, length));
+}
+async_end
+
+async(BufferedSPIFlash::MassErase)
+async_def()
+{
+    Discard(0, ~0u);
+    await(FlushOverlap, 0, ~0u);
+    await(flash.MassErase);
+}
+async_end
+
+async(BufferedSPIFlash::Sync)
+async_def()
+{
+    await(Flush);
+    await(flash.Sync);
+}
+async_end
+
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/BufferedSPIFlash.h
+ */
+
+#pragma once
+
+#include <storage/SPIFlash.h>
+
+namespace storage
+{
+
+//! SPI flash memory with a page-sized write-back buffer
+/*!
+ * Writes are collected in the buffer and programmed in a single operation when
+ * a different page is written, @ref Flush or @ref Sync is called, or an operation
+ * touching the buffered page requires the data to be in the flash memory.
+ *
+ * Durability: data written is visible to reads immediately, but only reaches
+ * the flash memory when the buffer is flushed. Flushes preserve the order of
+ * writes to different pages. Writes to the same page are programmed together,
+ * so their relative order is lost - a power failure during the program can leave
+ * any subset of their bits programmed - journals that must detect such torn
+ * records should use @ref ChecksumJournalFormat.
+ */
+class BufferedSPIFlash
+{
+public:
+    BufferedSPIFlash(SPIFlash& flash)
+        : flash(flash) {}
+
+    //! Initialize the underlying SPI flash memory
+    async(Init) { return async_forward(flash.Init); }
+    //! Checks if the underlying SPI flash memory is initialized
+    bool IsInitialized() const { return flash.init; }
+    //! Gets the underlying SPI flash memory
+    SPIFlash& Flash() const { return flash; }
+
+    //! Reads data from the SPI flash memory into the specified buffer, including buffered data
+    async(Read, uint32_t addr, Buffer data);
+    //! Reads data from the SPI flash memory into the specified memory location (e.g. hardware register)
+    async(ReadToRegister, uint32_t addr, volatile void* reg, size_t length);
+    //! Reads data from the SPI flash memory directly into the specified I/O pipe
+    async(ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout = Timeout::Infinite);
+    //! Writes data to the page buffer, flushing the previously buffered page if necessary
+    async(Write, uint32_t addr, Span data);
+    //! Writes data to the SPI flash memory directly from the specified I/O pipe
+    async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout = Timeout::Infinite);
+    //! Fills a range of the SPI flash memory
+    async(Fill, uint32_t addr, uint8_t value, size_t length);
+    //! Checks if a range of the SPI flash memory is empty
+    async(IsEmpty, uint32_t addr, size_t length) { return async_forward(IsAll, addr, 0xFF, length); }
+    //! Checks if a range of the SPI flash memory is filled with the specified value
+    async(IsAll, uint32_t addr, uint8_t value, size_t length);
+    //! Programs the buffered data into the SPI flash memory
+    async(Flush);
+    //! Erases at least the specified range of the SPI flash memory, depending on smallest sector size
+    async(Erase, uint32_t addr, uint32_t length);
+    //! Erases the first block of the specified range of the SPI flash memory, depending on smallest block size
+    //! Returns the address of the next block to be erased
+    async(EraseFirst, uint32_t addr, uint32_t length);
+    //! Erases the entire SPI flash memory
+    async(MassErase);
+    //! Flushes the buffered data and makes sure all SPI flash write operations have completed
+    async(Sync);
+
+    //! Size of the SPI flash memory in bytes
+    uint32_t Size() const { return flash.Size(); }
+    //! Gets the n-th smallest sector size in bytes
+    uint32_t SectorSize(uint32_t n = 0) const { return flash.SectorSize(n); }
+
+private:
+    enum
+    {
+        PAGE_SIZE = SPIFlash::PAGE_SIZE,
+    };
+
+    SPIFlash& flash;
+    uint32_t pageAddr = ~0u;
+    uint16_t dirtyStart = PAGE_SIZE, dirtyEnd = 0;
+    bool flushing = false;
+    char page[PAGE_SIZE];
+
+    //! Checks if there is buffered data overlapping the specified range
+    bool Overlaps(uint32_t addr, size_t length) const
+        { return dirtyStart < dirtyEnd && addr < pageAddr + dirtyEnd && addr + length > pageAddr + dirtyStart; }
+    //! Flushes the buffered data if it overlaps the specified range
+    async(FlushOverlap, uint32_t addr, size_t length);
+    //! Drops the buffered data if it lies completely within the specified range (which is being erased)
+    void Discard(uint32_t addr, size_t length);
+};
+
+}
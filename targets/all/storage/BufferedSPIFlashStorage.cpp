@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/BufferedSPIFlashStorage.cpp
+ */
+
+#include "BufferedSPIFlashStorage.h"
+
+namespace storage
+{
+
+async(BufferedSPIFlashStorage::Init, uint32_t start, size_t length)
+async_def()
+{
+    while (!flash.IsInitialized())
+    {
+        await(flash.Init);
+    }
+    this->start = start;
+    Initialize(nonzero(length, flash.Size() - start), flash.SectorSize());
+    ASSERT(start <= flash.Size());
+    ASSERT(start + Size() <= flash.Size());
+}
+async_end
+
+async(BufferedSPIFlashStorage::ReadImpl, uint32_t addr, void* buffer, size_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    return async_forward(flash.Read, start + addr, Buffer(buffer, length));
+}
+
+async(BufferedSPIFlashStorage::ReadToRegister, uint32_t addr, volatile void* reg, size_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    return async_forward(flash.ReadToRegister, start + addr, reg, length);
+}
+
+async(BufferedSPIFlashStorage::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    return async_forward(flash.ReadToPipe, pipe, start + addr, length, timeout);
+}
+
+
+async(BufferedSPIFlashStorage::WriteImpl, uint32_t addr, const void* buffer, size_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    return async_forward(flash.Write, start + addr, Span(buffer, length));
+}
+
+async(BufferedSPIFlashStorage::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    return async_forward(flash.WriteFromPipe, pipe, start + addr, length, timeout);
+}
+
+async(BufferedSPIFlashStorage::Fill, uint32_t addr, uint8_t value, size_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    return async_forward(flash.Fill, start + addr, value, length);
+}
+
+
+async(BufferedSPIFlashStorage::IsAll, uint32_t addr, uint8_t value, size_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Check, length);
+    return async_forward(flash.IsAll, start + addr, value, length);
+}
+
+async(BufferedSPIFlashStorage::Erase, uint32_t addr, uint32_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Erase, length);
+    return async_forward(flash.Erase, start + addr, length);
+}
+
+async(BufferedSPIFlashStorage::EraseFirst, uint32_t addr, uint32_t length)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Erase, SectorSize());
+    return async_forward(flash.EraseFirst, start + addr, length);
+}
+
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/ByteStorage.cpp
+ */
+
+#include "ByteStorage.h"
+
+namespace storage
+{
+
+async(ByteStorage::ReadV, const ReadSegment* segments, size_t count)
+async_def(
+    size_t i;
+)
+{
+    for (f.i = 0; f.i < count; f.i++)
+    {
+        await(Read, segments[f.i].addr, segments[f.i].data);
+    }
+}
+async_end
+
+async(ByteStorage::WriteV, const WriteSegment* segments, size_t count)
+async_def(
+    size_t i;
+)
+{
+    for (f.i = 0; f.i < count; f.i++)
+    {
+        await(Write, segments[f.i].addr, segments[f.i].data);
+    }
+}
+async_end
+
+}
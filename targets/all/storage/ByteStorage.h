@@ -13,6 +13,8 @@
 #include <io/PipeReader.h>
 #include <io/PipeWriter.h>
 
+#include <storage/IOStats.h>
+
 namespace storage
 {
 
@@ -23,6 +25,20 @@ class ByteStorageSpan;
 class ByteStorage
 {
 public:
+    //! Segment of the storage read by @ref ReadV
+    struct ReadSegment
+    {
+        uint32_t addr;
+        Buffer data;
+    };
+
+    //! Segment of data written by @ref WriteV
+    struct WriteSegment
+    {
+        uint32_t addr;
+        Span data;
+    };
+
     //! Reads data from the storage into the specified buffer
     async(Read, uint32_t addr, Buffer data) { return async_forward(ReadImpl, addr, data.Pointer(), data.Length()); }
     //! Reads data from the storage into the specified memory location (e.g. hardware register)
@@ -33,6 +49,10 @@ public:
     async(Write, uint32_t addr, Span data) { return async_forward(WriteImpl, addr, data.Pointer(), data.Length()); }
     //! Writes data to the storage directly from the specified I/O pipe
     virtual async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout = Timeout::Infinite) = 0;
+    //! Reads multiple segments of the storage, implementations can merge adjacent segments into a single transaction
+    virtual async(ReadV, const ReadSegment* segments, size_t count);
+    //! Writes multiple segments of data to the storage, implementations can merge adjacent segments into a single transaction
+    virtual async(WriteV, const WriteSegment* segments, size_t count);
     //! Fills a range of the storage with the specified value
     virtual async(Fill, uint32_t addr, uint8_t value, size_t length) = 0;
     //! Checks if a range of the storage is empty
@@ -46,8 +66,20 @@ public:
     virtual async(EraseFirst, uint32_t addr, uint32_t length) = 0;
     //! Erases the entire storage
     async(EraseAll) { return async_forward(Erase, 0, size); }
+    //! Pushes any data buffered by the implementation to the underlying medium, without waiting for completion
+    virtual async(Flush) async_def_return(true);
     //! Makes sure all write operations have completed
     virtual async(Sync) = 0;
+    //! Gets a pointer through which the specified range of the storage can be read directly
+    /*!
+     * Storage mapped into the address space (internal flash, memory-mapped QSPI)
+     * allows synchronous, zero-copy reads; the pointer is valid until the range is
+     * modified. The default implementation returns NULL, i.e. the range must be read
+     * using @ref Read
+     */
+    virtual const void* GetDirectPointer(uint32_t addr, size_t length) { return NULL; }
+    //! Checks if the specified range of the storage can be accessed directly
+    bool IsMapped(uint32_t addr, size_t length) { return GetDirectPointer(addr, length) != NULL; }
 
     //! Size of the storage in bytes
     constexpr size_t Size() const { return size; }
@@ -71,6 +103,13 @@ public:
     //! Gets the span representing the rest of the specified sector (from addr to end)
     ByteStorageSpan RestOfSectorSpan(uint32_t addr);
 
+    //! Gets the I/O statistics of the storage, users (e.g. JournalStorage) can add their own events
+    IOStats& Stats() { return stats; }
+    //! Gets the I/O statistics of the storage
+    const IOStats& Stats() const { return stats; }
+    //! Resets the I/O statistics of the storage
+    void ResetStats() { stats.Reset(); }
+
 protected:
     void Initialize(size_t size, size_t sectorSize)
     {
@@ -85,6 +124,8 @@ protected:
     //! Writes data to the storage - implementation
     virtual async(WriteImpl, uint32_t addr, const void* buffer, size_t length) = 0;
 
+    IOStats stats = {};
+
 private:
     size_t size = 0, sectorMask = 0;
 };
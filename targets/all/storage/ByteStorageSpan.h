@@ -39,6 +39,10 @@ public:
     async(Fill, size_t offset, uint8_t value, size_t length) const
         { return async_forward(storage->Fill, addr + offset, value, LimitLength(offset, length)); }
 
+    //! Gets a pointer through which part of the span can be read directly, NULL if not mapped (see @ref ByteStorage::GetDirectPointer)
+    const void* GetDirectPointer(size_t offset, size_t length) const
+        { return offset + length <= this->length ? storage->GetDirectPointer(addr + offset, length) : NULL; }
+
     //! Size of the storage span in bytes
     constexpr size_t Size() const { return length; }
     //! Offset of the storage span in the ByteStorage
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/ChecksumJournalFormat.cpp
+ */
+
+#include "ChecksumJournalFormat.h"
+
+using namespace storage;
+
+namespace
+{
+
+//! Lookup tables for slice-by-4 CRC-32 calculation
+struct Crc32Tables
+{
+    uint32_t t[4][256];
+
+    constexpr Crc32Tables()
+        : t()
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+            }
+            t[0][i] = crc;
+        }
+
+        for (unsigned i = 0; i < 256; i++)
+        {
+            for (int n = 1; n < 4; n++)
+            {
+                t[n][i] = (t[n - 1][i] >> 8) ^ t[0][t[n - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+constexpr Crc32Tables s_crc32;
+
+}
+
+uint32_t ChecksumJournalFormat::Crc32(uint32_t crc, Span data)
+{
+    auto p = (const uint8_t*)data.Pointer();
+    size_t len = data.Length();
+    crc = ~crc;
+
+    // process four bytes at a time
+    while (len >= 4)
+    {
+        crc ^= p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+        crc = s_crc32.t[3][crc & 0xFF] ^ s_crc32.t[2][(crc >> 8) & 0xFF] ^
+            s_crc32.t[1][(crc >> 16) & 0xFF] ^ s_crc32.t[0][crc >> 24];
+        p += 4;
+        len -= 4;
+    }
+
+    while (len--)
+    {
+        crc = (crc >> 8) ^ s_crc32.t[0][(crc ^ *p++) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+async(ChecksumJournalFormat::ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const
+async_def(
+    PageHeader ph;
+)
+{
+    await(sector.Read, 0, f.ph);
+    info.firstRecord = sizeof(PageHeader);
+    info.sequence = f.ph.sequence;
+    if (Span(f.ph).IsAllOnes())
+    {
+        info.state = SectorState::Empty;
+    }
+    else if (f.ph.magic != magic ||
+        (sectorChecksum && f.ph.crc != Checksum(Span(&f.ph, offsetof(PageHeader, crc)))))
+    {
+        info.state = SectorState::Bad;
+    }
+    else if (following != NULL && f.ph.sequence + 1 == following->sequence)
+    {
+        info.state = SectorState::ValidPreceding;
+    }
+    else
+    {
+        info.state = SectorState::Valid;
+    }
+}
+async_end
+
+async(ChecksumJournalFormat::ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const
+async_def(
+    RecordHeader hdr;
+)
+{
+    await(sectorRemaining.Read, 0, f.hdr);
+    info.payload = f.hdr.Size();
+    info.nextRecord = info.payload + sizeof(RecordHeader);
+    if (f.hdr.IsEmpty())
+    {
+        info.state = RecordState::Empty;
+    }
+    else if (f.hdr.IsBad())
+    {
+        info.state = RecordState::Bad;
+    }
+    else
+    {
+        info.state = RecordState::Valid;
+    }
+    async_return(sizeof(RecordHeader));
+}
+async_end
+
+intptr_t ChecksumJournalFormat::ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const
+{
+    RecordHeader hdr;
+    if (data.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    memcpy(&hdr, data.Pointer(), sizeof(hdr));
+    info.payload = hdr.Size();
+    info.nextRecord = info.payload + sizeof(RecordHeader);
+    if (hdr.IsEmpty())
+    {
+        info.state = RecordState::Empty;
+    }
+    else if (hdr.IsBad())
+    {
+        info.state = RecordState::Bad;
+    }
+    else if (data.Length() < info.nextRecord)
+    {
+        // checksum cannot be verified without the complete payload
+        return -1;
+    }
+    else if (Checksum(data.RemoveLeft(sizeof(hdr)).Left(info.payload)) != hdr.Crc())
+    {
+        info.state = RecordState::Bad;
+    }
+    else
+    {
+        info.state = RecordState::Valid;
+    }
+    return sizeof(RecordHeader);
+}
+
+async(ChecksumJournalFormat::InitSector, const ByteStorageSpan& sector, SectorInfo& info)
+async_def(
+    PageHeader ph;
+)
+{
+    info.sequence = (info.IsValid() ? info.sequence : 0) + 1;
+    f.ph.magic = magic;
+    f.ph.sequence = info.sequence;
+    f.ph.crc = sectorChecksum ? Checksum(Span(&f.ph, offsetof(PageHeader, crc))) : ~0u;
+    // magic is written last, marking the sector valid
+    await(sector.Write, offsetof(PageHeader, sequence), Span(&f.ph.sequence, sizeof(PageHeader) - offsetof(PageHeader, sequence)));
+    await(sector.Write, offsetof(PageHeader, magic), magic);
+    info.firstRecord = sizeof(PageHeader);
+    info.state = SectorState::Valid;
+}
+async_end
+
+intptr_t ChecksumJournalFormat::PrepareHeader(const ByteStorageSpan& sectorRemaining, RecordHeader& hdr, RecordInfo& info, size_t payload) const
+{
+    // limit the payload to theoretical maximum
+    hdr.size = std::min(payload, size_t(0x7FFF));
+    hdr.crc[0] = hdr.crc[1] = 0xFFFF;
+
+    if ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) == sizeof(PageHeader))
+    {
+        // further limit the payload to sector maximum
+        hdr.size = std::min(size_t(hdr.size), sectorRemaining.Size() - sizeof(RecordHeader));
+    }
+
+    if (sizeof(RecordHeader) + hdr.size > sectorRemaining.Size())
+    {
+        // sector is full, record won't fit
+        info.state = RecordState::Bad;
+        info.nextRecord = 0;
+        return 0;
+    }
+
+    hdr.size |= 0x8000;   // mark as unfinished
+    info.payload = hdr.Size();
+    info.nextRecord = sizeof(RecordHeader) + info.payload;
+    info.state = RecordState::Valid;
+    return sizeof(RecordHeader);
+}
+
+async(ChecksumJournalFormat::InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload)
+async_def(
+    RecordHeader hdr;
+)
+{
+    if (!PrepareHeader(sectorRemaining, f.hdr, info, payload))
+    {
+        async_return(0);
+    }
+
+    await(sectorRemaining.Write, 0, f.hdr.size);
+    async_return(sizeof(RecordHeader));
+}
+async_end
+
+async(ChecksumJournalFormat::StoredChecksum, const ByteStorageSpan& payload) const
+async_def(
+    uint8_t buf[VERIFY_CHUNK];
+    size_t offset, len;
+    uint32_t crc;
+)
+{
+    for (f.offset = 0; f.offset < payload.Size(); f.offset += f.len)
+    {
+        f.len = std::min(payload.Size() - f.offset, sizeof(f.buf));
+        await(payload.Read, f.offset, Buffer(f.buf, f.len));
+        f.crc = Checksum(Span(f.buf, f.len), f.crc);
+    }
+    async_return(f.crc);
+}
+async_end
+
+async(ChecksumJournalFormat::VerifyRecord, const ByteStorageSpan& payload, uint32_t state) const
+async_def(
+    uint16_t crcWords[2];
+)
+{
+    // only the stored checksum is read, the payload has been checksummed by the caller
+    await(payload.Storage().Read, payload.Offset() - sizeof(RecordHeader) + offsetof(RecordHeader, crc), f.crcWords);
+    async_return(state == (f.crcWords[0] | uint32_t(f.crcWords[1]) << 16));
+}
+async_end
+
+async(ChecksumJournalFormat::CommitRecord, const ByteStorageSpan& payload)
+async_def(
+    uint32_t crc;
+    uint16_t crcWords[2];
+)
+{
+    ASSERT(payload.Storage().IsSameSector(payload.Offset(), payload.Offset() - sizeof(RecordHeader)));
+
+    // calculate the checksum from the data actually stored
+    f.crc = await(StoredChecksum, payload);
+
+    f.crcWords[0] = f.crc;
+    f.crcWords[1] = f.crc >> 16;
+    await(payload.Storage().Write, payload.Offset() - sizeof(RecordHeader) + offsetof(RecordHeader, crc), f.crcWords);
+    // clear the top bit in the length field
+    await(payload.Storage().Write, payload.Offset() - sizeof(RecordHeader), (const uint16_t[]){0x7FFF});
+}
+async_end
+
+intptr_t ChecksumJournalFormat::PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload)
+{
+    RecordHeader hdr;
+    if (header.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    intptr_t res = PrepareHeader(sectorRemaining, hdr, info, payload);
+    if (res)
+    {
+        memcpy(header.Pointer(), &hdr, sizeof(hdr));
+    }
+    return res;
+}
+
+void ChecksumJournalFormat::PrepareCommit(Buffer record, const RecordInfo& info)
+{
+    RecordHeader hdr;
+    uint32_t crc = Checksum(record.RemoveLeft(sizeof(hdr)).Left(info.PayloadLength()));
+    hdr.size = 0x7FFF;
+    hdr.crc[0] = crc;
+    hdr.crc[1] = crc >> 16;
+    memset(record.Pointer(), 0xFF, info.NextRecordOffset());
+    memcpy(record.Pointer(), &hdr, sizeof(hdr));
+}
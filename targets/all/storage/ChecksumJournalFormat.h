@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/ChecksumJournalFormat.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/JournalFormat.h>
+
+namespace storage
+{
+
+//! Variable record journal format protecting each record with a CRC-32
+/*!
+ * The checksum is calculated from the payload read back from storage when
+ * the record is committed. It is verified when records are read in bulk
+ * by @ref JournalStorage::ReadRecords or streamed by @ref JournalStorage::ReadRecordsToPipe,
+ * enumeration using @ref JournalStorage::NextRecord only checks the record headers.
+ * The sector header can be protected as well.
+ */
+class ChecksumJournalFormat : public JournalFormat
+{
+public:
+    ChecksumJournalFormat(uint32_t magic, bool sectorChecksum = false)
+        : magic(magic), sectorChecksum(sectorChecksum) {}
+
+    //! Updates a running CRC-32 (IEEE 802.3) with the specified data
+    static uint32_t Crc32(uint32_t crc, Span data);
+
+protected:
+    //! Calculates the checksum of the specified data, can be overridden to use a hardware CRC unit
+    virtual uint32_t Checksum(Span data, uint32_t crc = 0) const { return Crc32(crc, data); }
+
+private:
+    uint32_t magic;
+    bool sectorChecksum;
+
+    struct PageHeader
+    {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t crc;
+    };
+
+    struct RecordHeader
+    {
+        uint16_t size;
+        uint16_t crc[2];
+
+        constexpr bool IsEmpty() const { return size == 0xFFFF; }
+        constexpr bool IsBad() const { return size & 0x8000; }
+        constexpr size_t Size() const { return size & 0x7FFF; }
+        constexpr uint32_t Crc() const { return crc[0] | crc[1] << 16; }
+    };
+
+    enum
+    {
+        VERIFY_CHUNK = 32,
+    };
+
+    intptr_t PrepareHeader(const ByteStorageSpan& sectorRemaining, RecordHeader& hdr, RecordInfo& info, size_t payload) const;
+
+    virtual async(ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const final override;
+    virtual async(ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual intptr_t ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual async(InitSector, const ByteStorageSpan& sector, SectorInfo& info) final override;
+    virtual async(InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload) final override;
+    virtual async(CommitRecord, const ByteStorageSpan& payload) final override;
+    virtual intptr_t PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload) final override;
+    virtual void PrepareCommit(Buffer record, const RecordInfo& info) final override;
+    virtual bool VerifiesRecords() const final override { return true; }
+    virtual uint32_t UpdateVerification(uint32_t state, Span data) const final override { return Checksum(data, state); }
+    virtual async(VerifyRecord, const ByteStorageSpan& payload, uint32_t state) const final override;
+
+    //! Calculates the checksum of a payload from the data actually stored
+    async(StoredChecksum, const ByteStorageSpan& payload) const;
+};
+
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/DeltaJournal.cpp
+ */
+
+#include "DeltaJournal.h"
+
+namespace storage
+{
+
+size_t DeltaEncoder::Encode(const int32_t* sample, Buffer out)
+{
+    auto p = (uint8_t*)out.Pointer();
+    size_t n = 0;
+
+    for (size_t i = 0; i < fields; i++)
+    {
+        int32_t delta = int32_t(uint32_t(sample[i]) - uint32_t(prev[i]));
+        uint32_t v = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31);
+        do
+        {
+            if (n == out.Length())
+            {
+                return 0;
+            }
+            p[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+            v >>= 7;
+        } while (v);
+    }
+
+    // the sample fits, it becomes the base of the next one
+    memcpy(prev, sample, fields * sizeof(int32_t));
+    return n;
+}
+
+size_t DeltaDecoder::Decode(Span data)
+{
+    auto p = (const uint8_t*)data.Pointer();
+    size_t n = 0;
+
+    complete = false;
+    while (n < data.Length())
+    {
+        uint8_t b = p[n++];
+        if (shift < 32)
+        {
+            acc |= uint32_t(b & 0x7F) << shift;
+        }
+        if (b & 0x80)
+        {
+            shift += 7;
+            continue;
+        }
+
+        value[field] = int32_t(uint32_t(value[field]) + ((acc >> 1) ^ -(acc & 1)));
+        acc = 0;
+        shift = 0;
+        if (++field == fields)
+        {
+            field = 0;
+            complete = true;
+            break;
+        }
+    }
+
+    return n;
+}
+
+async(DeltaJournalWriter::Write, const int32_t* sample)
+async_def(
+    size_t n;
+)
+{
+    f.n = encoder.Encode(sample, Buffer((uint8_t*)block.Pointer() + used, block.Length() - used));
+    if (!f.n)
+    {
+        if (!await(Flush))
+        {
+            async_return(false);
+        }
+        f.n = encoder.Encode(sample, block);
+    }
+
+    used += f.n;
+    samples++;
+    async_return(true);
+}
+async_end
+
+async(DeltaJournalWriter::Flush)
+async_def()
+{
+    if (!used)
+    {
+        async_return(true);
+    }
+
+    if (!await(journal.Write, Span(block.Pointer(), used), stream))
+    {
+        async_return(false);
+    }
+
+    // the next record starts a new series
+    encoder.Reset();
+    used = samples = 0;
+    async_return(true);
+}
+async_end
+
+bool DeltaJournalReader::DecodeRecord(const JournalStorage::RecordEnumerator& re, Span data)
+{
+    decoder.Reset();
+    for (size_t n = 0; n < data.Length();)
+    {
+        n += decoder.Decode(Span((const uint8_t*)data.Pointer() + n, data.Length() - n));
+        if (decoder.Complete())
+        {
+            samples++;
+            if (!callback(re, decoder.Sample()))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+async(DeltaJournalReader::ReadRecords, JournalStorage::RecordEnumerator& re, Buffer buf, SampleCallback callback)
+async_def()
+{
+    this->callback = callback;
+    samples = 0;
+    // the decoder is reused, a record interrupted in ReadToPipe cannot be resumed anymore
+    resume = false;
+    await(journal.ReadRecords, re, buf, GetDelegate(this, &DeltaJournalReader::DecodeRecord));
+    async_return(samples);
+}
+async_end
+
+async(DeltaJournalReader::ReadToPipe, JournalStorage::SectorEnumerator& se, JournalStorage::RecordEnumerator& re, io::PipeWriter pipe, Timeout timeout)
+async_def(
+    uint8_t chunk[CHUNK_SIZE];
+    size_t len, used, n, count;
+)
+{
+    if (!se)
+    {
+        resume = false;
+        if (!await(journal.NextSector, se))
+        {
+            async_return(0);
+        }
+        journal.EnumerateRecords(re, se);
+    }
+
+    for (;;)
+    {
+        if (resume && re.Address() == resumeRecord)
+        {
+            // continue the record interrupted by a timeout, the decoder still holds its state
+            resume = false;
+        }
+        else
+        {
+            resume = pending = false;
+            if (!await(journal.NextRecord, re))
+            {
+                if (!await(journal.NextSector, se))
+                {
+                    break;
+                }
+                journal.EnumerateRecords(re, se);
+                continue;
+            }
+
+            decoder.Reset();
+            resumeRecord = re.Address();
+            offset = 0;
+        }
+
+        f.len = f.used = 0;
+        while (pending || offset < re.Length())
+        {
+            if (!pending)
+            {
+                if (f.used == f.len)
+                {
+                    f.used = 0;
+                    if (!(f.len = await(journal.ReadRecord, re, Buffer(f.chunk, sizeof(f.chunk)), offset)))
+                    {
+                        break;
+                    }
+                }
+
+                f.n = decoder.Decode(Span(f.chunk + f.used, f.len - f.used));
+                f.used += f.n;
+                offset += f.n;
+                if (!decoder.Complete())
+                {
+                    continue;
+                }
+                pending = true;
+            }
+
+            if (!await(WriteSample, pipe, timeout))
+            {
+                // the decoded sample stays pending until the next call
+                resume = true;
+                async_return(f.count);
+            }
+            pending = false;
+            f.count++;
+        }
+    }
+
+    async_return(f.count);
+}
+async_end
+
+async(DeltaJournalReader::WriteSample, io::PipeWriter pipe, Timeout timeout)
+async_def(
+    size_t size, written;
+)
+{
+    // space for the whole sample is allocated first, a timeout never leaves a part of it in the pipe
+    f.size = decoder.Fields() * sizeof(int32_t);
+    if (pipe.Available() < f.size && !await(pipe.Allocate, f.size, timeout))
+    {
+        async_return(false);
+    }
+
+    while (f.written < f.size)
+    {
+        Buffer buf = pipe.GetBuffer().Left(f.size - f.written);
+        memcpy(buf.Pointer(), (const uint8_t*)decoder.Sample() + f.written, buf.Length());
+        pipe.Advance(buf.Length());
+        f.written += buf.Length();
+    }
+
+    async_return(true);
+}
+async_end
+
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/DeltaJournal.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/JournalStorage.h>
+
+namespace storage
+{
+
+//! Encodes series of samples consisting of 32-bit integer fields
+/*!
+ * Each field is stored as the zigzag varint of the difference from the same
+ * field of the previous sample, so slowly changing values take a single byte.
+ * The first sample after @ref Reset is encoded against zeroes.
+ */
+class DeltaEncoder
+{
+public:
+    enum
+    {
+        MAX_FIELDS = 16,
+        //! Maximum encoded size of a single field
+        MAX_FIELD_SIZE = 5,
+    };
+
+    DeltaEncoder(size_t fields)
+        : fields(fields) { ASSERT(fields && fields <= MAX_FIELDS); Reset(); }
+
+    //! Starts a new series
+    void Reset() { memset(prev, 0, sizeof(prev)); }
+    //! Encodes a sample of @ref Fields values
+    //! @returns the number of bytes stored in @p out, 0 (without encoding the sample) if it does not fit
+    size_t Encode(const int32_t* sample, Buffer out);
+
+    //! Gets the number of fields in each sample
+    constexpr size_t Fields() const { return fields; }
+    //! Gets the maximum encoded size of a sample
+    constexpr size_t MaximumSampleSize() const { return fields * MAX_FIELD_SIZE; }
+
+private:
+    size_t fields;
+    int32_t prev[MAX_FIELDS];
+};
+
+//! Decodes series of samples encoded by @ref DeltaEncoder
+/*!
+ * The encoded data can be fed in arbitrary chunks, partially decoded
+ * samples are kept in the decoder
+ */
+class DeltaDecoder
+{
+public:
+    DeltaDecoder(size_t fields)
+        : fields(fields) { ASSERT(fields && fields <= DeltaEncoder::MAX_FIELDS); Reset(); }
+
+    //! Starts a new series
+    void Reset() { memset(value, 0, sizeof(value)); acc = 0; shift = 0; field = 0; complete = false; }
+    //! Decodes data up to the end of the next sample
+    //! @returns the number of bytes consumed, check @ref Complete to see if a sample has been decoded
+    size_t Decode(Span data);
+
+    //! Checks if the last call to @ref Decode completed a sample
+    constexpr bool Complete() const { return complete; }
+    //! Gets the last decoded sample
+    const int32_t* Sample() const { return value; }
+    //! Gets the number of fields in each sample
+    constexpr size_t Fields() const { return fields; }
+
+private:
+    size_t fields;
+    int32_t value[DeltaEncoder::MAX_FIELDS];
+    uint32_t acc;
+    uint8_t shift, field;
+    bool complete;
+};
+
+//! Collects delta-encoded samples into blocks, each written as a single journal record
+/*!
+ * Every record is a self-contained series, so records can be decoded independently
+ * of each other. The block buffer is the only memory used, it should not be larger
+ * than the maximum record size of the journal.
+ */
+class DeltaJournalWriter
+{
+public:
+    DeltaJournalWriter(JournalStorage& journal, size_t fields, Buffer block, unsigned stream = 0)
+        : journal(journal), encoder(fields), block(block), stream(stream) { ASSERT(block.Length() >= encoder.MaximumSampleSize()); }
+
+    //! Appends a sample, writing the current block to the journal first if the sample does not fit
+    async(Write, const int32_t* sample);
+    //! Writes the samples collected so far to the journal as a single record
+    async(Flush);
+
+    //! Gets the number of samples not written to the journal yet
+    size_t Pending() const { return samples; }
+
+private:
+    JournalStorage& journal;
+    DeltaEncoder encoder;
+    Buffer block;
+    unsigned stream;
+    size_t used = 0, samples = 0;
+};
+
+//! Decodes journal records written by @ref DeltaJournalWriter
+class DeltaJournalReader
+{
+public:
+    DeltaJournalReader(JournalStorage& journal, size_t fields)
+        : journal(journal), decoder(fields) {}
+
+    //! Callback receiving decoded samples by @ref ReadRecords, returns false to stop enumeration
+    typedef Delegate<bool, const JournalStorage::RecordEnumerator&, const int32_t*> SampleCallback;
+    //! Reads the remaining records of the enumerator sector in bulk and decodes their samples
+    /*!
+     * See @ref JournalStorage::ReadRecords, @param callback is invoked for each sample
+     * with the enumerator positioned at the record containing it
+     * @returns the number of samples passed to the callback
+     */
+    async(ReadRecords, JournalStorage::RecordEnumerator& e, Buffer buf, SampleCallback callback);
+    //! Streams the decoded samples of all records following the enumerators into an I/O pipe
+    /*!
+     * Samples are written as arrays of 32-bit fields, records are read in small chunks
+     * and decoded as they arrive. Samples are only written to the pipe as a whole - if
+     * the pipe times out, the enumerator is left positioned at the current record and
+     * the next call with the same enumerators continues with the first sample that was
+     * not written. Invalid enumerators start at the first stored record.
+     * @returns the number of samples streamed completely
+     */
+    async(ReadToPipe, JournalStorage::SectorEnumerator& se, JournalStorage::RecordEnumerator& re, io::PipeWriter pipe, Timeout timeout = Timeout::Infinite);
+
+private:
+    enum
+    {
+        //! Size of the chunks read by @ref ReadToPipe
+        CHUNK_SIZE = 64,
+    };
+
+    JournalStorage& journal;
+    DeltaDecoder decoder;
+    SampleCallback callback;
+    size_t samples;
+    //! State of the record interrupted by a pipe timeout in @ref ReadToPipe
+    uint32_t resumeRecord;
+    size_t offset;          //< bytes of the record already decoded
+    bool resume = false;
+    bool pending = false;   //< the last decoded sample has not been written yet
+
+    bool DecodeRecord(const JournalStorage::RecordEnumerator& re, Span data);
+    //! Writes the last decoded sample into the pipe
+    async(WriteSample, io::PipeWriter pipe, Timeout timeout);
+};
+
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/FixedRecordJournalFormat.cpp
+ */
+
+#include "FixedRecordJournalFormat.h"
+
+using namespace storage;
+
+size_t FixedRecordJournalFormat::FirstRecord(size_t sectorSize) const
+{
+    // each slot needs recordSize bytes plus SLOT_BITS in the bitmap
+    size_t slots = (sectorSize - sizeof(PageHeader)) * SLOTS_PER_BYTE / (recordSize * SLOTS_PER_BYTE + 1);
+    size_t first;
+    while ((first = (sizeof(PageHeader) + (slots + SLOTS_PER_BYTE - 1) / SLOTS_PER_BYTE + 3) & ~3) + slots * recordSize > sectorSize)
+    {
+        // alignment of the first slot did not fit
+        slots--;
+    }
+    return first;
+}
+
+async(FixedRecordJournalFormat::ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const
+async_def(
+    PageHeader ph;
+)
+{
+    await(sector.Read, 0, f.ph);
+    info.firstRecord = FirstRecord(sector.Size());
+    info.fixedRecordSize = recordSize;
+    info.sequence = f.ph.sequence;
+    if (Span(f.ph).IsAllOnes())
+    {
+        info.state = SectorState::Empty;
+    }
+    else if (f.ph.magic != magic)
+    {
+        info.state = SectorState::Bad;
+    }
+    else if (following != NULL && f.ph.sequence + 1 == following->sequence)
+    {
+        info.state = SectorState::ValidPreceding;
+    }
+    else
+    {
+        info.state = SectorState::Valid;
+    }
+}
+async_end
+
+async(FixedRecordJournalFormat::ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const
+async_def(
+    size_t slot;
+    uint8_t bits;
+)
+{
+    info.payload = recordSize;
+    info.nextRecord = recordSize;
+    if (sectorRemaining.Size() < recordSize)
+    {
+        // no more slots in the sector
+        info.state = RecordState::Bad;
+        info.nextRecord = 0;
+        async_return(0);
+    }
+
+    f.slot = ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) - sectorInfo.firstRecord) / recordSize;
+    await(sectorRemaining.Storage().Read, SlotBitmap(sectorRemaining.Storage().SectorAddress(sectorRemaining.Offset()), f.slot), f.bits);
+    if (f.bits & SlotMask(f.slot, SLOT_ALLOCATED))
+    {
+        info.state = RecordState::Empty;
+    }
+    else if (f.bits & SlotMask(f.slot, SLOT_COMMITTED))
+    {
+        info.state = RecordState::Bad;
+    }
+    else
+    {
+        info.state = RecordState::Valid;
+    }
+    async_return(0);
+}
+async_end
+
+async(FixedRecordJournalFormat::InitSector, const ByteStorageSpan& sector, SectorInfo& info)
+async_def()
+{
+    info.sequence = (info.IsValid() ? info.sequence : 0) + 1;
+    await(sector.Write, offsetof(PageHeader, sequence), info.sequence);
+    await(sector.Write, offsetof(PageHeader, magic), magic);
+    info.firstRecord = FirstRecord(sector.Size());
+    info.fixedRecordSize = recordSize;
+    info.state = SectorState::Valid;
+}
+async_end
+
+async(FixedRecordJournalFormat::InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload)
+async_def(
+    size_t slot;
+    uint8_t bits;
+)
+{
+    if (sectorRemaining.Size() < recordSize)
+    {
+        // sector is full
+        info.state = RecordState::Bad;
+        info.nextRecord = 0;
+        async_return(0);
+    }
+
+    f.slot = ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) - FirstRecord(sectorRemaining.Storage().SectorSize())) / recordSize;
+    f.bits = ~SlotMask(f.slot, SLOT_ALLOCATED);
+    await(sectorRemaining.Storage().Write, SlotBitmap(sectorRemaining.Storage().SectorAddress(sectorRemaining.Offset()), f.slot), f.bits);
+    // payload is limited to the slot size
+    info.payload = std::min(payload, size_t(recordSize));
+    info.nextRecord = recordSize;
+    info.state = RecordState::Valid;
+    async_return(0);
+}
+async_end
+
+async(FixedRecordJournalFormat::CommitRecord, const ByteStorageSpan& payload)
+async_def(
+    size_t slot;
+    uint8_t bits;
+)
+{
+    f.slot = ((payload.Offset() & payload.Storage().SectorMask()) - FirstRecord(payload.Storage().SectorSize())) / recordSize;
+    f.bits = ~SlotMask(f.slot, SLOT_COMMITTED);
+    await(payload.Storage().Write, SlotBitmap(payload.Storage().SectorAddress(payload.Offset()), f.slot), f.bits);
+}
+async_end
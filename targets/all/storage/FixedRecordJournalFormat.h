@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/FixedRecordJournalFormat.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/JournalFormat.h>
+
+namespace storage
+{
+
+//! Journal format storing records of a fixed size in slots
+/*!
+ * Each sector starts with a header followed by a bitmap with two bits per slot
+ * (allocated, committed) and the record slots themselves. Records carry no
+ * headers, the address of any slot can be calculated directly.
+ */
+class FixedRecordJournalFormat : public JournalFormat
+{
+public:
+    FixedRecordJournalFormat(uint32_t magic, uint8_t recordSize)
+        : magic(magic), recordSize(recordSize) { ASSERT(recordSize > 0); }
+
+private:
+    uint32_t magic;
+    uint8_t recordSize;
+
+    struct PageHeader
+    {
+        uint32_t magic;
+        uint32_t sequence;
+    };
+
+    enum
+    {
+        SLOT_ALLOCATED = 1,
+        SLOT_COMMITTED = 2,
+        SLOT_BITS = 2,
+        SLOTS_PER_BYTE = 8 / SLOT_BITS,
+    };
+
+    //! Calculates the offset of the first slot in a sector of the specified size
+    size_t FirstRecord(size_t sectorSize) const;
+    //! Gets the bitmap bit mask for the specified slot
+    static constexpr uint8_t SlotMask(size_t slot, uint8_t bit) { return bit << (slot % SLOTS_PER_BYTE * SLOT_BITS); }
+    //! Gets the address of the bitmap byte for the specified slot
+    static constexpr uint32_t SlotBitmap(uint32_t sector, size_t slot) { return sector + sizeof(PageHeader) + slot / SLOTS_PER_BYTE; }
+
+    virtual async(ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const final override;
+    virtual async(ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual async(InitSector, const ByteStorageSpan& sector, SectorInfo& info) final override;
+    virtual async(InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload) final override;
+    virtual async(CommitRecord, const ByteStorageSpan& payload) final override;
+};
+
+}
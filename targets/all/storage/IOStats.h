@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/IOStats.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+namespace storage
+{
+
+//! Runtime I/O statistics collected by storage implementations
+/*!
+ * Collection is just a few increments per operation, so it is always enabled.
+ * Latencies are kept as log2 histograms - bucket 0 counts zero latencies,
+ * bucket n counts latencies in the range [2^(n-1), 2^n), the last bucket
+ * collects everything above. Latency units are implementation-specific,
+ * hardware implementations use microseconds (see @ref Microseconds), so the
+ * buckets cover everything from single transfers to multi-second erases.
+ */
+struct IOStats
+{
+    enum Op
+    {
+        Read,
+        Write,
+        Erase,
+        Check,
+
+        OpCount,
+    };
+
+    enum
+    {
+        HISTOGRAM_BUCKETS = 24,
+    };
+
+    struct OpStats
+    {
+        uint32_t count;                         //!< number of operations
+        uint32_t bytes;                         //!< total bytes transferred (or checked/erased)
+        uint32_t latency[HISTOGRAM_BUCKETS];    //!< log2 histogram of operation latencies
+    };
+
+    OpStats op[OpCount];
+    uint32_t cacheHits, cacheMisses;    //!< read cache lookups
+    uint32_t busyPolls;                 //!< number of times a busy device was checked for completion
+    uint64_t busyTime;                  //!< total time the device was busy, in latency units
+    uint32_t rollovers;                 //!< journal sectors started
+    uint32_t badRecords;                //!< invalid journal records skipped
+
+    //! Counts an operation
+    void Count(Op o, size_t bytes) { op[o].count++; op[o].bytes += bytes; }
+    //! Records the latency of an operation
+    void Latency(Op o, uint32_t time) { op[o].latency[Bucket(time)]++; }
+    //! Resets all statistics
+    void Reset() { *this = {}; }
+
+    //! Converts a MONO_CLOCKS interval to microseconds, the latency unit of hardware implementations
+    static uint32_t Microseconds(mono_t clocks) { return uint32_t(uint64_t(clocks) * 1000000 / MONO_FREQUENCY); }
+    //! Gets the histogram bucket for the specified latency
+    static unsigned Bucket(uint32_t time) { return time ? std::min(unsigned(HISTOGRAM_BUCKETS - 1), unsigned(32 - __builtin_clz(time))) : 0; }
+};
+
+}
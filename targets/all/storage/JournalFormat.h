@@ -33,6 +33,7 @@ protected:
         uint16_t firstRecord;
         uint8_t fixedRecordSize;
         SectorState state;
+        uint32_t streams;   //!< bitmap of streams with records in the sector, only for formats with multiple streams
 
         constexpr bool IsBad() const { return state == SectorState::Bad; }
         constexpr bool IsEmpty() const { return state == SectorState::Empty; }
@@ -52,6 +53,7 @@ protected:
         uint16_t payload;
         uint16_t nextRecord;
         RecordState state;
+        uint8_t stream;     //!< stream the record belongs to, always 0 for formats without multiple streams
 
         constexpr bool IsBad() const { return state == RecordState::Bad; }
         constexpr bool IsEmpty() const { return state == RecordState::Empty; }
@@ -77,6 +79,7 @@ protected:
      *    - @param info.firstRecord is the first record offset
      *    - @param info.fixedRecordSize is set to either 0, or the record size if the sector contains fixed-size records
      *    - @param info.sequence is the relative sector sequence number
+     *    - @param info.streams is the bitmap of streams present in the sector, if @ref MaximumStreams is > 1
      *  - @return value is ignored, @param info is used instead
      */
     virtual async(ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following = NULL) const = 0;
@@ -96,10 +99,29 @@ protected:
      *  - @param info.nextRecord is set to the offset of the next record *from the start of @param sectorRemaining*
      *      must be set when state is Valid, can be set when record is Bad
      *      and it is possible to skip the bad record
+     *  - @param info.stream is set to the stream of the record, if @ref MaximumStreams is > 1
      *  - @returns the offset of the payload *from the start of @param sectorRemaining*
      */
     virtual async(ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const = 0;
 
+    //! Parses a record from data already read into memory
+    /*!
+     * Equivalent of @ref ScanRecord operating on a memory buffer, used for bulk
+     * record enumeration. The default implementation does not support parsing
+     * and all records are scanned using @ref ScanRecord instead.
+     *
+     * Provided input:
+     *  - @param data is a Span containing the rest of the sector (or a part of it), starting at record position
+     *  - @param sectorInfo must be the SectorInfo returned from a ScanSector operation on the sector
+     *  - @param info is a preallocated RecordInfo structure expected to receive the record parse results
+     * Expected output:
+     *  - the same as @ref ScanRecord
+     *  - @returns the offset of the payload *from the start of @param data*,
+     *    or a negative value if @param data does not contain enough data
+     *    to parse the record header
+     */
+    virtual intptr_t ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const { return -1; }
+
     //! Initializes a new sector
     /*!
      * Provided input:
@@ -114,6 +136,7 @@ protected:
      *    - @param info.firstRecord is the first record offset
      *    - @param info.fixedRecordSize is set to either 0, or the record size if the sector contains fixed-size records
      *    - @param info.sequence is the relative sector sequence number
+     *    - @param info.streams is cleared, if @ref MaximumStreams is > 1
      */
     virtual async(InitSector, const ByteStorageSpan& sector, SectorInfo& info) = 0;
 
@@ -121,10 +144,10 @@ protected:
     /*!
      * Provided input:
      *  - @param sectorRemaining is a ByteStorageSpan representing the rest of the sector, starting at record position
-     *  - @param info is a preallocated RecordInfo structure expected to receive the state of the new record
+     *  - @param info is a preallocated RecordInfo structure expected to receive the state of the new record,
+     *    with @param info.stream set to the stream of the record
      *  - @param payload is the requested number of record payload bytes
      * Expected output:
-     * Expected output:
      *  - @param info.state is set to
      *    - @ref RecordState::Bad if the record could not be allocated
      *    - @ref RecordState::Valid otherwise
@@ -145,6 +168,88 @@ protected:
      */
     virtual async(CommitRecord, const ByteStorageSpan& payload) = 0;
 
+    //! Prepares a new record in memory, used for batched writes
+    /*!
+     * Equivalent of @ref InitRecord that stores the uncommitted record header into
+     * @param header instead of writing it to storage. The default implementation
+     * does not support batching and records are written one by one instead.
+     *
+     * Provided input:
+     *  - @param sectorRemaining is a ByteStorageSpan representing the rest of the sector, starting at record position
+     *  - @param header is a memory buffer expected to receive the record header
+     *  - @param info is a preallocated RecordInfo structure expected to receive the state of the new record,
+     *    with @param info.stream set to the stream of the record
+     *  - @param payload is the requested number of record payload bytes
+     * Expected output:
+     *  - the same as @ref InitRecord
+     *  - @returns the offset of the payload *from the start of @param header*,
+     *    or a negative value if the record cannot be prepared in memory
+     */
+    virtual intptr_t PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload) { return -1; }
+
+    //! Prepares the commit of a record previously prepared using @ref PrepareRecord
+    /*!
+     * Provided input:
+     *  - @param record is a memory buffer containing the complete record prepared using
+     *    @ref PrepareRecord, including the payload (@param info.nextRecord bytes)
+     *  - @param info is the RecordInfo returned from @ref PrepareRecord
+     * Expected output:
+     *  - @param record is replaced with the bytes that mark the record as valid when
+     *    programmed over it, with all other bytes set to 0xFF
+     */
+    virtual void PrepareCommit(Buffer record, const RecordInfo& info) {}
+
+    //! Checks if the format verifies record payloads using @ref UpdateVerification and @ref VerifyRecord
+    virtual bool VerifiesRecords() const { return false; }
+
+    //! Updates the verification state (e.g. a running checksum) of a payload with the next part of its data
+    /*!
+     * Used where the payload does not pass through @ref ParseRecord, e.g. when it is
+     * streamed directly from storage. The caller feeds the payload in parts as it reads
+     * it, starting with a zero state, so that no byte has to be read twice.
+     * The default implementation has nothing to verify.
+     */
+    virtual uint32_t UpdateVerification(uint32_t state, Span data) const { return state; }
+
+    //! Verifies the payload of a record found using @ref ScanRecord
+    /*!
+     * Provided input:
+     *  - @param payload is a ByteStorageSpan representing the payload of a valid record
+     *  - @param state is the result of @ref UpdateVerification over the complete payload
+     * Expected output:
+     *  - @returns true if the payload matches its stored checksum, false if the record is corrupted
+     */
+    virtual async(VerifyRecord, const ByteStorageSpan& payload, uint32_t state) const async_def_return(true);
+
+    //! Gets the number of streams supported by the format
+    /*!
+     * Formats supporting multiple streams store the stream of each record and
+     * keep a bitmap of streams present in each sector, so that enumerators of
+     * a single stream can skip sectors without its records
+     */
+    virtual unsigned MaximumStreams() const { return 1; }
+
+    //! Marks a stream as present in a sector, before its first record is written to it
+    /*!
+     * Provided input:
+     *  - @param sector is a ByteStorageSpan representing the entire sector
+     *  - @param info is the SectorInfo of the sector
+     *  - @param stream is the stream about to be written to the sector
+     * Expected output:
+     *  - the bit of the stream is set in @param info.streams
+     * Called only for formats where @ref MaximumStreams is > 1
+     */
+    virtual async(MarkStream, const ByteStorageSpan& sector, SectorInfo& info, unsigned stream) async_def_return(false);
+
+    //! Gets the offset of the 32-bit erase counter in each sector, 0 if the format does not count erases
+    /*!
+     * The counter is maintained by @ref JournalStorage, which reads it before erasing
+     * a sector and programs the incremented value right after the erase. The format
+     * must reserve the location, must not program it in @ref InitSector and must
+     * still report a sector containing just the counter as @ref SectorState::Empty
+     */
+    virtual size_t EraseCounterOffset() const { return 0; }
+
 private:
     friend class JournalStorage;
 };
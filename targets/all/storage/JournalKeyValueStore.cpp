@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/JournalKeyValueStore.cpp
+ */
+
+#include "JournalKeyValueStore.h"
+
+#define MYDBG(...)  DBGCL("KVStore", __VA_ARGS__)
+
+namespace storage
+{
+
+JournalKeyValueStore::JournalKeyValueStore(JournalStorage& journal, size_t budget)
+    : journal(journal)
+{
+    // largest power of two that fits into the budget
+    capacity = budget / sizeof(Entry);
+    bits = capacity ? 31 - __builtin_clz(capacity) : 0;
+    capacity = 1u << bits;
+    index = new Entry[capacity]();
+}
+
+JournalKeyValueStore::Entry* JournalKeyValueStore::Find(uint32_t key) const
+{
+    // at least one slot is always kept free, so the probe terminates
+    // Fibonacci hashing, the high bits of the product are the well mixed ones
+    size_t mask = capacity - 1;
+    size_t i = bits ? uint32_t(key * 2654435761u) >> (32 - bits) : 0;
+    while (index[i].addr && index[i].key != key)
+    {
+        i = (i + 1) & mask;
+    }
+    return &index[i];
+}
+
+void JournalKeyValueStore::Update(uint32_t key, uint32_t addr, size_t length)
+{
+    auto e = Find(key);
+    if (!e->addr)
+    {
+        if (count + 1 >= capacity)
+        {
+            if (!overflow)
+            {
+                MYDBG("Index full with %d keys, lookups of other keys will replay the journal", count);
+                overflow = true;
+            }
+            return;
+        }
+        e->key = key;
+        count++;
+    }
+    e->addr = addr;
+    e->length = length;
+}
+
+async(JournalKeyValueStore::Scan)
+async_def(
+    JournalStorage::SectorEnumerator se;
+    JournalStorage::RecordEnumerator re;
+    uint32_t key;
+)
+{
+    memset(index, 0, capacity * sizeof(Entry));
+    count = 0;
+    overflow = false;
+
+    await(journal.Scan);
+
+    journal.EnumerateSectors(f.se);
+    while (await(journal.NextSector, f.se))
+    {
+        journal.EnumerateRecords(f.re, f.se);
+        while (await(journal.NextRecord, f.re))
+        {
+            if (await(journal.ReadRecord, f.re, Buffer(&f.key, sizeof(f.key))) == sizeof(f.key))
+            {
+                Update(f.key, f.re.Address(), f.re.Length());
+            }
+        }
+    }
+
+    MYDBG("Indexed %d keys", count);
+}
+async_end
+
+async(JournalKeyValueStore::Replay, uint32_t key, Entry& e)
+async_def(
+    JournalStorage::SectorEnumerator se;
+    JournalStorage::RecordEnumerator re;
+    uint32_t key;
+)
+{
+    e = {};
+
+    // newest sector first, the last matching record in the sector wins
+    journal.EnumerateSectors(f.se);
+    while (!e.addr && await(journal.PreviousSector, f.se))
+    {
+        journal.EnumerateRecords(f.re, f.se);
+        while (await(journal.NextRecord, f.re))
+        {
+            if (await(journal.ReadRecord, f.re, Buffer(&f.key, sizeof(f.key))) == sizeof(f.key) && f.key == key)
+            {
+                e.key = key;
+                e.addr = f.re.Address();
+                e.length = f.re.Length();
+            }
+        }
+    }
+
+    async_return(!!e.addr);
+}
+async_end
+
+async(JournalKeyValueStore::Get, uint32_t key, Buffer value)
+async_def(
+    Entry e;
+    uint32_t stored;
+    bool replay;
+    ByteStorage::ReadSegment seg[2];
+)
+{
+    f.e = *Find(key);
+    // the index does not know the latest record
+    f.replay = f.e.addr ? !journal.IsStored(f.e.addr) : overflow;
+
+    for (;;)
+    {
+        if (f.replay)
+        {
+            if (await(Replay, key, f.e))
+            {
+                Update(key, f.e.addr, f.e.length);
+            }
+        }
+
+        if (!f.e.addr || f.e.length <= sizeof(key))
+        {
+            async_return(0);
+        }
+
+        // the key is read back with the value, the indexed sector may have been reused
+        f.seg[0] = { f.e.addr, Buffer(&f.stored, sizeof(f.stored)) };
+        f.seg[1] = { f.e.addr + sizeof(key), value.Left(f.e.length - sizeof(key)) };
+        await(journal.storage.ReadV, f.seg, 2);
+
+        if (f.stored == key || f.replay)
+        {
+            break;
+        }
+
+        MYDBG("Record of key %X @ %X overwritten, replaying", key, f.e.addr);
+        f.replay = true;
+    }
+
+    async_return(f.e.length - sizeof(key));
+}
+async_end
+
+async(JournalKeyValueStore::Set, uint32_t key, Span value)
+async_def(
+    JournalStorage::RecordWriter rw;
+)
+{
+    if (!await(journal.BeginWrite, f.rw, sizeof(key) + value.Length()))
+    {
+        async_return(false);
+    }
+
+    await(f.rw.Write, 0, Span(&key, sizeof(key)));
+    await(f.rw.Write, sizeof(key), value);
+    await(journal.EndWrite, f.rw);
+    Update(key, f.rw.Offset(), sizeof(key) + value.Length());
+    async_return(true);
+}
+async_end
+
+void JournalKeyValueStore::EnableCompaction(Buffer buffer)
+{
+    journal.EnableCompaction(
+        GetDelegate(this, &JournalKeyValueStore::Retain),
+        buffer,
+        GetDelegate(this, &JournalKeyValueStore::Relocated));
+}
+
+bool JournalKeyValueStore::Retain(const JournalStorage::RecordEnumerator& re, Span data)
+{
+    uint32_t key;
+    if (data.Length() < sizeof(key))
+    {
+        return false;
+    }
+
+    memcpy(&key, data.Pointer(), sizeof(key));
+    auto e = Find(key);
+    if (!e->addr)
+    {
+        // unknown key, keep all its records if the index cannot tell which one is the latest
+        return overflow;
+    }
+
+    // only the latest value is kept, deleted keys are dropped with the sector
+    return e->addr == re.Address() && e->length > sizeof(key);
+}
+
+void JournalKeyValueStore::Relocated(uint32_t from, uint32_t to, Span data)
+{
+    uint32_t key;
+    if (data.Length() >= sizeof(key))
+    {
+        memcpy(&key, data.Pointer(), sizeof(key));
+        auto e = Find(key);
+        if (e->addr == from)
+        {
+            e->addr = to;
+        }
+        return;
+    }
+
+    // records copied in parts are reported without payload, find the entry by address
+    for (size_t i = 0; i < capacity; i++)
+    {
+        if (index[i].addr == from)
+        {
+            index[i].addr = to;
+            return;
+        }
+    }
+}
+
+}
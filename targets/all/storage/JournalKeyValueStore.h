@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/JournalKeyValueStore.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/JournalStorage.h>
+
+namespace storage
+{
+
+//! Log-structured key-value store on top of @ref JournalStorage
+/*!
+ * Each value is stored as a journal record consisting of a 32-bit key followed
+ * by the value, the latest record of each key wins and an empty value marks
+ * the key as deleted. A RAM index (open addressing, key to record address)
+ * is rebuilt by @ref Scan, so @ref Get needs just a single read from storage.
+ * The key is read back together with the value, if the indexed sector has
+ * been reused by the wrapping ring since, the key is looked up by replaying.
+ *
+ * If the index runs out of space, keys missing from it are looked up by
+ * replaying the journal from the newest sector. Use @ref EnableCompaction
+ * to keep the latest values when the journal ring wraps around.
+ */
+class JournalKeyValueStore
+{
+public:
+    //! Creates a store with an index occupying at most @p budget bytes of RAM
+    JournalKeyValueStore(JournalStorage& journal, size_t budget);
+    ~JournalKeyValueStore() { delete[] index; }
+
+    //! Scans the journal and rebuilds the index
+    async(Scan);
+    //! Reads the latest value of the key
+    //! @returns the length of the value (possibly larger than @p value), 0 if the key is not stored
+    async(Get, uint32_t key, Buffer value);
+    //! Stores a new value of the key, an empty value deletes the key
+    async(Set, uint32_t key, Span value);
+    //! Deletes the key
+    async(Delete, uint32_t key) { return async_forward(Set, key, Span()); }
+    //! Keeps the latest values of keys when the journal reclaims its oldest sector
+    void EnableCompaction(Buffer buffer);
+
+    //! Gets the number of keys in the index (including deleted ones)
+    size_t Count() const { return count; }
+    //! Checks if the index ran out of space and lookups may need to replay the journal
+    bool Overflow() const { return overflow; }
+
+private:
+    struct Entry
+    {
+        uint32_t key;
+        uint32_t addr;      //< payload address of the latest record, 0 if the slot is free
+        uint16_t length;    //< payload length of the latest record, including the key
+    };
+
+    JournalStorage& journal;
+    Entry* index;
+    size_t capacity, count = 0;
+    //! log2 of the capacity
+    uint8_t bits;
+    bool overflow = false;
+
+    //! Finds the slot of the key, or the free slot where it belongs
+    Entry* Find(uint32_t key) const;
+    //! Records the latest record of the key in the index
+    void Update(uint32_t key, uint32_t addr, size_t length);
+    //! Finds the latest record of a key missing from the index by replaying the journal
+    async(Replay, uint32_t key, Entry& e);
+
+    bool Retain(const JournalStorage::RecordEnumerator& re, Span data);
+    void Relocated(uint32_t from, uint32_t to, Span data);
+};
+
+}
@@ -18,11 +18,20 @@ async_def(
     JournalFormat::SectorInfo si;
     JournalFormat::SectorInfo siFirst, siLast;
     SectorEnumerator se;
-    RecordEnumerator re;
 )
 {
     MYDBG("Scanning flash sectors");
     lastSector = ~0u;
+    preErased = 0;
+    lastPreErased = false;
+    if (table)
+    {
+        memset(table, 0, (storage.Size() >> storage.SectorSizeBits()) * sizeof(*table));
+    }
+    if (heads)
+    {
+        memset(heads, 0xFF, format.MaximumStreams() * sizeof(*heads));
+    }
 
     // first search for the last written sector (by sequence)
     // the first sector found is used to disambiguate the situation
@@ -31,6 +40,7 @@ async_def(
     {
         await(format.ScanSector, storage.SectorSpan(f.addr), f.si);
         async_yield();
+        TableSet(f.addr, f.si);
         if (f.si.IsEmpty())
         {
             MYTRACE(3, "Scanning %X - EMPTY", f.addr);
@@ -76,25 +86,12 @@ async_def(
     {
         MYDBG("Highest sequence sector found @ %X, seq %d", lastSector, f.siLast.sequence);
 
-        EnumerateRecords(f.re, lastSector);
-        while (await(NextRecord, f.re))
-        {
-        }
-
-        if (f.re.IsEmpty())
-        {
-            MYDBG("Last sector still has free space @ %X, will be used for new records", f.re.r);
-            freeOffset = f.re.r.addr - lastSector;
-        }
-        else
-        {
-            MYDBG("Last sector is full or corrupted @ %X", f.re.r);
-            freeOffset = 0;
-        }
+        await(FindFreeOffset);
 
         // now move back as far as the sequence numbers are contiguous
         f.siFirst = f.siLast;
         firstSector = lastSector;
+        SetStreamHeads(lastSector, f.siLast);
         for (f.addr = PreviousSector(lastSector); f.addr != lastSector; f.addr = PreviousSector(f.addr))
         {
             await(format.ScanSector, storage.SectorSpan(f.addr), f.si, &f.siFirst);
@@ -103,6 +100,7 @@ async_def(
             {
                 firstSector = f.addr;
                 f.siFirst = f.si;
+                SetStreamHeads(f.addr, f.si);
             }
             else if (f.si.IsValid())
             {
@@ -117,6 +115,301 @@ async_def(
 }
 async_end
 
+async(JournalStorage::FastScan)
+async_def(
+    size_t sectors, lo, hi, mid;
+    uint32_t seq0, prev;
+    JournalFormat::SectorInfo si;
+)
+{
+    if (heads)
+    {
+        MYDBG("Stream heads require all sector headers, using full scan");
+        await(Scan);
+        async_return(false);
+    }
+
+    MYDBG("Fast scanning flash sectors");
+    preErased = 0;
+    lastPreErased = false;
+    f.sectors = storage.Size() >> storage.SectorSizeBits();
+    if (table)
+    {
+        memset(table, 0, f.sectors * sizeof(*table));
+    }
+
+    await(format.ScanSector, storage.SectorSpan(0), f.si);
+    TableSet(0, f.si);
+    if (!f.si.IsValid())
+    {
+        MYDBG("First sector is not valid, falling back to full scan");
+        await(Scan);
+        async_return(false);
+    }
+
+    // sectors are written in ring order, so the sectors following sector 0
+    // up to the head continue its sequence - find the last one that does
+    f.seq0 = f.si.sequence;
+    f.lo = 0;
+    f.hi = f.sectors;
+    while (f.hi - f.lo > 1)
+    {
+        f.mid = (f.lo + f.hi) / 2;
+        await(format.ScanSector, storage.SectorSpan(f.mid << storage.SectorSizeBits()), f.si);
+        async_yield();
+        TableSet(f.mid << storage.SectorSizeBits(), f.si);
+        MYTRACE(2, "Probing %X - seq %d", f.mid << storage.SectorSizeBits(), f.si.IsValid() ? f.si.sequence : 0);
+        if (f.si.IsValid() && f.si.sequence == uint32_t(f.seq0 + f.mid))
+        {
+            f.lo = f.mid;
+        }
+        else
+        {
+            f.hi = f.mid;
+        }
+    }
+
+    lastSector = f.lo << storage.SectorSizeBits();
+
+    if (f.lo + 1 < f.sectors)
+    {
+        // the sector following the head must be empty or from the previous pass
+        await(format.ScanSector, storage.SectorSpan(NextSector(lastSector)), f.si);
+        TableSet(NextSector(lastSector), f.si);
+        if (f.si.IsBad() || (f.si.IsValid() && !OVF_LT(f.si.sequence, f.seq0)))
+        {
+            MYDBG("Unexpected sector sequence @ %X, falling back to full scan", NextSector(lastSector));
+            await(Scan);
+            async_return(false);
+        }
+    }
+
+    // sectors from the previous pass end just before sector 0 - find the first one
+    // still continuing its sequence
+    f.hi = f.sectors;
+    while (f.hi - f.lo > 1)
+    {
+        f.mid = (f.lo + f.hi) / 2;
+        await(format.ScanSector, storage.SectorSpan(f.mid << storage.SectorSizeBits()), f.si);
+        async_yield();
+        TableSet(f.mid << storage.SectorSizeBits(), f.si);
+        MYTRACE(2, "Probing %X - seq %d", f.mid << storage.SectorSizeBits(), f.si.IsValid() ? f.si.sequence : 0);
+        if (f.si.IsValid() && f.si.sequence == uint32_t(f.seq0 - (f.sectors - f.mid)))
+        {
+            f.hi = f.mid;
+        }
+        else
+        {
+            f.lo = f.mid;
+        }
+    }
+
+    firstSector = f.hi == f.sectors ? 0 : f.hi << storage.SectorSizeBits();
+
+    // the binary searches assume ring order, verify the boundaries they found
+    if (firstSector)
+    {
+        await(format.ScanSector, storage.SectorSpan(firstSector), f.si);
+        if (!f.si.IsValid() || f.si.sequence != uint32_t(f.seq0 - (f.sectors - f.hi)))
+        {
+            MYDBG("Unexpected first sector sequence @ %X, falling back to full scan", firstSector);
+            await(Scan);
+            async_return(false);
+        }
+    }
+
+    f.prev = (firstSector ? firstSector : storage.Size()) - storage.SectorSize();
+    if (f.prev != lastSector)
+    {
+        // the sector preceding the first one must not hold any data
+        await(format.ScanSector, storage.SectorSpan(f.prev), f.si);
+        if (f.si.IsValid())
+        {
+            MYDBG("Unexpected sector sequence @ %X, falling back to full scan", f.prev);
+            await(Scan);
+            async_return(false);
+        }
+    }
+
+    await(format.ScanSector, storage.SectorSpan(lastSector), last);
+    MYDBG("Highest sequence sector found @ %X, seq %d", lastSector, last.sequence);
+    await(FindFreeOffset);
+    MYDBG("Stored sectors %X - %X", firstSector, lastSector);
+    async_return(true);
+}
+async_end
+
+bool JournalStorage::EnableSectorTable()
+{
+    size_t sectors = storage.Size() >> storage.SectorSizeBits();
+    if (sectors > TABLE_SEQ_MASK)
+    {
+        // sequence numbers could not be reconstructed from the stored bits
+        return false;
+    }
+
+    if (!table)
+    {
+        table = new uint16_t[sectors]();
+    }
+    return true;
+}
+
+bool JournalStorage::EnableStreamHeads()
+{
+    if (format.MaximumStreams() <= 1)
+    {
+        return false;
+    }
+
+    if (!heads)
+    {
+        heads = new uint32_t[format.MaximumStreams()];
+        memset(heads, 0xFF, format.MaximumStreams() * sizeof(*heads));
+    }
+    return true;
+}
+
+bool JournalStorage::StreamHead(SectorEnumerator& se, unsigned stream) const
+{
+    if (!heads || stream >= format.MaximumStreams() || heads[stream] == ~0u)
+    {
+        return false;
+    }
+
+    se = SectorEnumerator(stream);
+    se.s = heads[stream];
+    return true;
+}
+
+void JournalStorage::SetStreamHeads(uint32_t addr, const JournalFormat::SectorInfo& si)
+{
+    if (!heads)
+    {
+        return;
+    }
+
+    // sectors are visited from the newest, keep the first one found for each stream
+    for (unsigned i = 0; i < format.MaximumStreams(); i++)
+    {
+        if (heads[i] == ~0u && (si.streams & (1u << i)))
+        {
+            heads[i] = addr;
+        }
+    }
+}
+
+void JournalStorage::TableSet(uint32_t addr, const JournalFormat::SectorInfo& si)
+{
+    if (!table)
+    {
+        return;
+    }
+
+    uint16_t& e = table[addr >> storage.SectorSizeBits()];
+    if (si.IsValid())
+    {
+        e = TABLE_VALID | (si.sequence & TABLE_SEQ_MASK) << TABLE_SEQ_SHIFT;
+        tableLayout.firstRecord = si.firstRecord;
+        tableLayout.fixedRecordSize = si.fixedRecordSize;
+    }
+    else
+    {
+        e = si.IsEmpty() ? TABLE_EMPTY : TABLE_BAD;
+    }
+}
+
+async(JournalStorage::GetSectorInfo, uint32_t addr, JournalFormat::SectorInfo& si)
+async_def()
+{
+    if (table)
+    {
+        uint16_t e = table[addr >> storage.SectorSizeBits()];
+        switch (e & TABLE_STATE_MASK)
+        {
+            case TABLE_VALID:
+                si = tableLayout;
+                si.state = JournalFormat::SectorState::Valid;
+                // stream bitmaps are not kept in the table
+                si.streams = ~0u;
+                // all valid sectors in the ring are within TABLE_SEQ_MASK of the last one
+                si.sequence = last.sequence - ((last.sequence - (e >> TABLE_SEQ_SHIFT)) & TABLE_SEQ_MASK);
+                async_return(true);
+
+            case TABLE_EMPTY:
+                si.state = JournalFormat::SectorState::Empty;
+                async_return(true);
+
+            case TABLE_BAD:
+                si.state = JournalFormat::SectorState::Bad;
+                async_return(true);
+        }
+    }
+
+    await(format.ScanSector, storage.SectorSpan(addr), si);
+    TableSet(addr, si);
+    async_return(false);
+}
+async_end
+
+async(JournalStorage::FindFreeOffset)
+async_def(
+    RecordEnumerator re;
+    JournalFormat::RecordInfo ri;
+    size_t lo, hi, mid;
+)
+{
+    if (last.fixedRecordSize)
+    {
+        // binary search for the first empty slot, slots are allocated in order
+        f.lo = 0;
+        f.hi = (storage.SectorSize() - last.firstRecord) / last.fixedRecordSize + 1;
+        while (f.hi - f.lo > 1)
+        {
+            f.mid = (f.lo + f.hi) / 2;
+            await(format.ScanRecord, storage.RestOfSectorSpan(lastSector + last.firstRecord + (f.mid - 1) * last.fixedRecordSize), last, f.ri);
+            if (f.ri.IsEmpty())
+            {
+                f.hi = f.mid;
+            }
+            else
+            {
+                f.lo = f.mid;
+            }
+        }
+
+        // lo is the number of used slots
+        freeOffset = last.firstRecord + f.lo * last.fixedRecordSize;
+        if (freeOffset + last.fixedRecordSize > storage.SectorSize())
+        {
+            MYDBG("Last sector is full @ %X", lastSector + freeOffset);
+            freeOffset = 0;
+        }
+        else
+        {
+            MYDBG("Last sector still has free space @ %X, will be used for new records", lastSector + freeOffset);
+        }
+        async_return(true);
+    }
+
+    EnumerateRecords(f.re, lastSector);
+    while (await(NextRecord, f.re))
+    {
+    }
+
+    if (f.re.IsEmpty())
+    {
+        MYDBG("Last sector still has free space @ %X, will be used for new records", f.re.r);
+        freeOffset = f.re.r.addr - lastSector;
+    }
+    else
+    {
+        MYDBG("Last sector is full or corrupted @ %X", f.re.r);
+        freeOffset = 0;
+    }
+}
+async_end
+
 async(JournalStorage::PreviousSector, SectorEnumerator& se)
 async_def(
     JournalFormat::SectorInfo si;
@@ -126,7 +419,7 @@ async_def(
     {
         if (se.s.addr == firstSector)
         {
-            se = SectorEnumerator();
+            se = SectorEnumerator(se.stream);
             async_return(false);
         }
 
@@ -139,8 +432,8 @@ async_def(
             se.s.addr = PreviousSector(se.s.addr);
         }
 
-        await(format.ScanSector, storage.SectorSpan(se.s.addr), f.si);
-        if (f.si.IsValid())
+        await(GetSectorInfo, se.s.addr, f.si);
+        if (f.si.IsValid() && HasStream(f.si, se.stream))
         {
             async_return(true);
         }
@@ -157,7 +450,7 @@ async_def(
     {
         if (se.s.addr == lastSector)
         {
-            se = SectorEnumerator();
+            se = SectorEnumerator(se.stream);
             async_return(false);
         }
 
@@ -170,8 +463,8 @@ async_def(
             se.s.addr = NextSector(se.s.addr);
         }
 
-        await(format.ScanSector, storage.SectorSpan(se.s.addr), f.si);
-        if (f.si.IsValid())
+        await(GetSectorInfo, se.s.addr, f.si);
+        if (f.si.IsValid() && HasStream(f.si, se.stream))
         {
             async_return(true);
         }
@@ -199,14 +492,15 @@ async_def(
     JournalFormat::RecordInfo ri;
 )
 {
+    re.streamed = 0;
     if (re.r.addr == re.rNext.addr && re.si.IsBad())
     {
         // we need the sector header before enumerating
-        await(format.ScanSector, storage.SectorSpan(re.r.addr), re.si);
+        await(GetSectorInfo, re.r.addr, re.si);
         re.rNext = re.r.addr + re.si.firstRecord;
     }
 
-    if (!re.si.IsValid())
+    if (!re.si.IsValid() || !HasStream(re.si, re.stream))
     {
         async_return(0);
     }
@@ -223,6 +517,7 @@ async_def(
         re.rNext = re.r.addr + f.ri.NextRecordOffset();
         if (f.ri.IsBad())
         {
+            storage.Stats().badRecords++;
             if (re.rNext.addr != re.r.addr)
             {
                 // skip over the bad record
@@ -233,9 +528,16 @@ async_def(
             async_return(0);
         }
 
+        if (re.stream != AnyStream && f.ri.stream != re.stream)
+        {
+            // foreign record
+            continue;
+        }
+
         // move address to payload, return payload length
         re.r.addr += payloadOffset;
         re.len = f.ri.PayloadLength();
+        re.recordStream = f.ri.stream;
         async_return(f.ri.PayloadLength());
     }
 
@@ -247,103 +549,575 @@ async_def(
 }
 async_end
 
-async(JournalStorage::ReadRecord, const RecordEnumerator& re, const Buffer& buf, size_t offset)
+async(JournalStorage::ReadRecordToPipe, const RecordEnumerator& re, io::PipeWriter pipe, size_t offset, Timeout timeout)
 async_def(
-    Buffer buf;
+    size_t len;
 )
 {
     if (re.si.IsValid() && offset < re.len)
     {
-        f.buf = buf.Left(re.len - offset);
-        await(storage.Read, re.r.addr + offset, f.buf);
-        async_return(f.buf.Length());
+        f.len = await(storage.ReadToPipe, pipe, re.r.addr + offset, re.len - offset, timeout);
     }
-    async_return(0);
+    async_return(f.len);
 }
 async_end
 
-async(JournalStorage::BeginWrite, RecordWriter& writer, size_t length)
+async(JournalStorage::ReadRecordsToPipe, SectorEnumerator& se, RecordEnumerator& re, io::PipeWriter pipe, FrameCallback framing, Timeout timeout)
 async_def(
-    JournalFormat::RecordInfo ri;
+    uint8_t frame[FRAME_MAX];
+    size_t count, len;
 )
 {
+    if (!se)
+    {
+        if (!await(NextSector, se))
+        {
+            async_return(0);
+        }
+        EnumerateRecords(re, se);
+    }
+
     for (;;)
     {
-        if (freeOffset == 0 || freeOffset >= storage.SectorSize())
+        // a record interrupted by a timeout is resumed where it stopped
+        if (!re.streamed)
         {
-            await(NewSector);
-            ASSERT(freeOffset > 0 && freeOffset < storage.SectorSize());
+            if (!await(NextRecord, re))
+            {
+                if (!await(NextSector, se))
+                {
+                    break;
+                }
+                EnumerateRecords(re, se);
+                continue;
+            }
+
+            re.verification = 0;
         }
 
-        intptr_t payloadOffset;
-        payloadOffset = await(format.InitRecord, storage.RestOfSectorSpan(lastSector + freeOffset), f.ri, length);
-        freeOffset += f.ri.nextRecord;
-        maxRecord = std::max(0, int(storage.SectorSize() - freeOffset - payloadOffset));
-        if (f.ri.IsValid())
+        // the frame is produced again when resuming, only the missing part is written
+        f.len = framing ? framing(re, Buffer(f.frame, sizeof(f.frame))) : 0;
+        if (re.streamed < f.len)
         {
-            writer.Init(storage.GetSpan(lastSector + freeOffset - f.ri.nextRecord + payloadOffset, f.ri.payload));
-            async_return(true);
+            re.streamed += await(WriteToPipe, pipe, Span(f.frame + re.streamed, f.len - re.streamed), timeout);
+            if (re.streamed < f.len)
+            {
+                break;
+            }
         }
 
-        if (!(f.ri.IsBad() && f.ri.nextRecord))
+        if (re.streamed < f.len + re.len)
         {
-            // cannot try next record, have to move to next sector
-            freeOffset = storage.SectorSize();
+            if (format.VerifiesRecords())
+            {
+                re.streamed += await(ReadVerifiedToPipe, re, pipe, re.streamed - f.len, timeout);
+            }
+            else
+            {
+                re.streamed += await(storage.ReadToPipe, pipe, re.r.addr + re.streamed - f.len, f.len + re.len - re.streamed, timeout);
+            }
+            if (re.streamed < f.len + re.len)
+            {
+                break;
+            }
+        }
+        re.streamed = 0;
+
+        if (!await(format.VerifyRecord, storage.GetSpan(re.r.addr, re.len), re.verification))
+        {
+            // the payload is already in the pipe, the corruption can only be reported
+            MYDBG("Corrupted record streamed @ %X", re.r.addr);
+            storage.Stats().badRecords++;
+            continue;
         }
+        f.count++;
     }
+
+    async_return(f.count);
 }
 async_end
 
-async(JournalStorage::AdvanceSector)
+async(JournalStorage::ReadVerifiedToPipe, RecordEnumerator& re, io::PipeWriter pipe, size_t offset, Timeout timeout)
 async_def(
-    uint32_t addr;
-    JournalFormat::SectorInfo si;
+    size_t read;
+    Buffer buf;
 )
 {
-    lastSector = NextSector(lastSector);
-    freeOffset = 0;
-    MYTRACE(1, "Advancing to sector %X", lastSector);
-
-    if (lastSector != firstSector)
+    while (offset + f.read < re.len)
     {
-        async_return(true);
+        if (!pipe.Available() && !await(pipe.Allocate, re.len - offset - f.read, timeout))
+        {
+            break;
+        }
+
+        // the payload is read into the pipe buffer and checksummed before it is released to the reader
+        f.buf = pipe.GetBuffer().Left(re.len - offset - f.read);
+        await(storage.Read, re.r.addr + offset + f.read, f.buf);
+        re.verification = format.UpdateVerification(re.verification, f.buf);
+        pipe.Advance(f.buf.Length());
+        f.read += f.buf.Length();
     }
 
-    // first sector is about to be overwritten
-    for (f.addr = NextSector(firstSector); f.addr != lastSector; f.addr = NextSector(f.addr))
+    async_return(f.read);
+}
+async_end
+
+async(JournalStorage::WriteToPipe, io::PipeWriter pipe, Span data, Timeout timeout)
+async_def(
+    size_t written;
+)
+{
+    while (f.written < data.Length())
     {
-        await(format.ScanSector, storage.SectorSpan(f.addr), f.si);
-        async_yield();
-        if (f.si.IsValid())
+        if (!pipe.Available() && !await(pipe.Allocate, data.Length() - f.written, timeout))
         {
-            firstSector = f.addr;
-            MYDBG("Moved first sector to %X - %d, it is going to be overwritten", f.addr, f.si.sequence);
-            async_return(true);
+            break;
+        }
+
+        {
+            Buffer buf = pipe.GetBuffer().Left(data.Length() - f.written);
+            memcpy(buf.Pointer(), (const uint8_t*)data.Pointer() + f.written, buf.Length());
+            pipe.Advance(buf.Length());
+            f.written += buf.Length();
         }
     }
 
-    // if we didn't find a new firstSector, just keep firstSector == lastSector
-    MYTRACE(1, "No valid first sector, keeping at %X", firstSector);
+    async_return(f.written);
 }
 async_end
 
-async(JournalStorage::NewSector)
-async_def()
+async(JournalStorage::SeekRecord, RecordEnumerator& re, size_t index)
+async_def(
+    uint32_t sector;
+    Record r;
+    size_t i;
+    JournalFormat::RecordInfo ri;
+)
 {
-    if (freeOffset)
+    f.sector = storage.SectorAddress(re.r.addr);
+    if (!re.si.IsValid())
     {
-        await(AdvanceSector);
+        await(GetSectorInfo, f.sector, re.si);
+        if (!re.si.IsValid())
+        {
+            async_return(false);
+        }
     }
 
-    for (;;)
+    if (re.si.fixedRecordSize)
     {
-        if (!await(storage.IsEmpty, lastSector, storage.SectorSize()))
+        // slot address can be calculated directly
+        if (re.si.firstRecord + (index + 1) * re.si.fixedRecordSize > storage.SectorSize())
+        {
+            async_return(false);
+        }
+        re.r = re.rNext = f.sector + re.si.firstRecord + index * re.si.fixedRecordSize;
+        async_return(true);
+    }
+
+    // walk the record headers
+    f.r = f.sector + re.si.firstRecord;
+    for (f.i = 0; f.i < index; f.i++)
+    {
+        await(format.ScanRecord, storage.RestOfSectorSpan(f.r.addr), re.si, f.ri);
+        if (f.ri.IsEmpty() || !f.ri.NextRecordOffset())
+        {
+            async_return(false);
+        }
+        f.r.addr += f.ri.NextRecordOffset();
+        if (!storage.IsSameSector(f.sector, f.r.addr))
+        {
+            async_return(false);
+        }
+    }
+
+    re.r = re.rNext = f.r;
+    async_return(true);
+}
+async_end
+
+async(JournalStorage::Seek, SectorEnumerator& se, RecordEnumerator& re, Cursor cursor)
+async_def(
+    uint32_t addr, age;
+    size_t lo, hi, mid, k;
+    JournalFormat::SectorInfo si;
+)
+{
+    f.age = last.sequence - cursor.sequence;
+    f.addr = ~0u;
+
+    if (last.IsValid() && f.age <= SectorDistance(firstSector, lastSector))
+    {
+        // try the expected position first, valid unless bad sectors were skipped
+        await(GetSectorInfo, SectorAfter(lastSector, (storage.Size() >> storage.SectorSizeBits()) - f.age), f.si);
+        if (f.si.IsValid() && f.si.sequence == cursor.sequence)
+        {
+            f.addr = SectorAfter(lastSector, (storage.Size() >> storage.SectorSizeBits()) - f.age);
+        }
+        else
+        {
+            // binary search over the stored sectors, where sequence numbers are increasing
+            f.lo = 0;
+            f.hi = SectorDistance(firstSector, lastSector) + 1;
+            while (f.lo < f.hi)
+            {
+                f.mid = (f.lo + f.hi) / 2;
+                for (f.k = f.mid; f.k < f.hi; f.k++)
+                {
+                    // skip over invalid sectors
+                    await(GetSectorInfo, SectorAfter(firstSector, f.k), f.si);
+                    if (f.si.IsValid())
+                    {
+                        break;
+                    }
+                }
+
+                if (f.k == f.hi)
+                {
+                    f.hi = f.mid;
+                }
+                else if (f.si.sequence == cursor.sequence)
+                {
+                    f.addr = SectorAfter(firstSector, f.k);
+                    break;
+                }
+                else if (OVF_LT(f.si.sequence, cursor.sequence))
+                {
+                    f.lo = f.k + 1;
+                }
+                else
+                {
+                    f.hi = f.mid;
+                }
+            }
+        }
+    }
+
+    if (f.addr == ~0u || cursor.offset > storage.SectorSize())
+    {
+        MYDBG("Cursor %d:%X not found, starting at first sector", cursor.sequence, cursor.offset);
+        EnumerateSectors(se);
+        if (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+        }
+        async_return(false);
+    }
+
+    MYTRACE(2, "Cursor %d:%X found in sector %X", cursor.sequence, cursor.offset, f.addr);
+    se.s = f.addr;
+    re = RecordEnumerator(se);
+    re.si = f.si;
+    if (cursor.offset == storage.SectorSize())
+    {
+        // cursor at the end of the sector
+        re.r = f.addr;
+        re.rNext = f.addr + cursor.offset;
+    }
+    else
+    {
+        re.r = re.rNext = f.addr + std::max(cursor.offset, uint32_t(f.si.firstRecord));
+    }
+    async_return(true);
+}
+async_end
+
+async(JournalStorage::ReadRecord, const RecordEnumerator& re, const Buffer& buf, size_t offset)
+async_def(
+    Buffer buf;
+)
+{
+    if (re.si.IsValid() && offset < re.len)
+    {
+        f.buf = buf.Left(re.len - offset);
+        if (auto p = storage.GetDirectPointer(re.r.addr + offset, f.buf.Length()))
+        {
+            memcpy(f.buf.Pointer(), p, f.buf.Length());
+            async_return(f.buf.Length());
+        }
+        await(storage.Read, re.r.addr + offset, f.buf);
+        async_return(f.buf.Length());
+    }
+    async_return(0);
+}
+async_end
+
+async(JournalStorage::ReadRecords, RecordEnumerator& re, Buffer buf, RecordCallback callback)
+async_def(
+    Buffer chunk;
+    const void* mapped;
+    size_t count;
+    ParseResult res;
+)
+{
+    re.oversized = false;
+    if (re.r.addr == re.rNext.addr && re.si.IsBad())
+    {
+        // we need the sector header before enumerating
+        await(GetSectorInfo, re.r.addr, re.si);
+        re.rNext = re.r.addr + re.si.firstRecord;
+    }
+
+    while (re.si.IsValid() && HasStream(re.si, re.stream) && storage.IsSameSector(re.r.addr, re.rNext.addr))
+    {
+        f.chunk = buf.Left(storage.SectorAddress(re.rNext.addr) + storage.SectorSize() - re.rNext.addr);
+        if ((f.mapped = storage.GetDirectPointer(re.rNext.addr, f.chunk.Length())))
+        {
+            // mapped storage, parse the records in place
+            f.res = ParseRecords(re, Span(f.mapped, f.chunk.Length()), re.rNext.addr, callback, f.count);
+        }
+        else
+        {
+            await(storage.Read, re.rNext.addr, f.chunk);
+            f.res = ParseRecords(re, f.chunk, re.rNext.addr, callback, f.count);
+        }
+        if (f.res == ParseResult::Stop)
+        {
+            break;
+        }
+
+        if (f.res == ParseResult::Fallback)
+        {
+            // the format cannot parse the record from memory, use the regular path
+            if (!await(NextRecord, re))
+            {
+                break;
+            }
+
+            if (re.len > buf.Length())
+            {
+                re.oversized = true;
+                break;
+            }
+
+            await(ReadRecord, re, buf);
+            if (!await(format.VerifyRecord, storage.GetSpan(re.r.addr, re.len), format.UpdateVerification(0, buf.Left(re.len))))
+            {
+                // corrupted payload, skip it like ParseRecords does
+                storage.Stats().badRecords++;
+                continue;
+            }
+
+            f.count++;
+            if (!callback(re, buf.Left(re.len)))
+            {
+                break;
+            }
+        }
+    }
+
+    async_return(f.count);
+}
+async_end
+
+JournalStorage::ParseResult JournalStorage::ParseRecords(RecordEnumerator& re, Span chunk, uint32_t base, const RecordCallback& callback, size_t& count)
+{
+    JournalFormat::RecordInfo ri = {};
+
+    for (;;)
+    {
+        if (!storage.IsSameSector(re.r.addr, re.rNext.addr))
+        {
+            return ParseResult::Stop;
+        }
+
+        size_t offset = re.rNext.addr - base;
+        Span rest = chunk.RemoveLeft(offset);
+        intptr_t payloadOffset = format.ParseRecord(rest, re.si, ri);
+        if (payloadOffset < 0)
+        {
+            return offset ? ParseResult::More : ParseResult::Fallback;
+        }
+
+        if (ri.IsEmpty())
+        {
+            re.r = re.rNext;
+            return ParseResult::Stop;
+        }
+
+        if (ri.IsBad())
+        {
+            re.r = re.rNext;
+            re.rNext = re.r.addr + ri.NextRecordOffset();
+            storage.Stats().badRecords++;
+            if (re.rNext.addr != re.r.addr)
+            {
+                // skip over the bad record
+                continue;
+            }
+            // cannot continue, unable to skip
+            re.rNext.addr--;    // mark bad
+            return ParseResult::Stop;
+        }
+
+        bool fits = size_t(payloadOffset) + ri.PayloadLength() <= rest.Length();
+        if (!fits && offset)
+        {
+            // record crosses the end of the chunk, read again starting with it
+            return ParseResult::More;
+        }
+
+        re.r = re.rNext;
+        re.rNext = re.r.addr + ri.NextRecordOffset();
+        if (re.stream != AnyStream && ri.stream != re.stream)
+        {
+            // foreign record
+            continue;
+        }
+
+        re.r.addr += payloadOffset;
+        re.len = ri.PayloadLength();
+        re.recordStream = ri.stream;
+
+        if (!fits)
+        {
+            // record does not fit in the buffer at all, leave it to the caller
+            re.oversized = true;
+            return ParseResult::Stop;
+        }
+
+        count++;
+        if (!callback(re, rest.RemoveLeft(payloadOffset).Left(re.len)))
+        {
+            return ParseResult::Stop;
+        }
+    }
+}
+
+async(JournalStorage::BeginWrite, RecordWriter& writer, size_t length, unsigned stream)
+async_def(
+    JournalFormat::RecordInfo ri;
+)
+{
+    for (;;)
+    {
+        if (freeOffset == 0 || freeOffset >= storage.SectorSize())
+        {
+            if (compacting)
+            {
+                // relocated records must fit in the current sector
+                async_return(false);
+            }
+            await(NewSector);
+            ASSERT(freeOffset > 0 && freeOffset < storage.SectorSize());
+        }
+
+        if (!StreamMarked(stream))
+        {
+            await(MarkStream, stream);
+        }
+
+        f.ri.stream = stream;
+        intptr_t payloadOffset;
+        payloadOffset = await(format.InitRecord, storage.RestOfSectorSpan(lastSector + freeOffset), f.ri, length);
+        freeOffset += f.ri.nextRecord;
+        maxRecord = last.fixedRecordSize ? last.fixedRecordSize : std::max(0, int(storage.SectorSize() - freeOffset - payloadOffset));
+        if (f.ri.IsValid())
+        {
+            writer.Init(storage.GetSpan(lastSector + freeOffset - f.ri.nextRecord + payloadOffset, f.ri.payload));
+            lastRecord = writer.Offset();
+            async_return(true);
+        }
+
+        if (!(f.ri.IsBad() && f.ri.nextRecord))
+        {
+            // cannot try next record, have to move to next sector
+            freeOffset = storage.SectorSize();
+        }
+    }
+}
+async_end
+
+async(JournalStorage::AdvanceSector)
+async_def()
+{
+    lastSector = NextSector(lastSector);
+    freeOffset = 0;
+    MYTRACE(1, "Advancing to sector %X", lastSector);
+
+    if ((lastPreErased = preErased > 0))
+    {
+        // firstSector has already been moved when the sector was erased
+        preErased--;
+        async_return(true);
+    }
+
+    if (lastSector != firstSector)
+    {
+        async_return(true);
+    }
+
+    // first sector is about to be overwritten
+    await(DropFirstSector);
+}
+async_end
+
+async(JournalStorage::DropFirstSector)
+async_def(
+    uint32_t addr;
+    JournalFormat::SectorInfo si;
+)
+{
+    if (heads)
+    {
+        // streams with the last records in the dropped sector are gone
+        for (unsigned i = 0; i < format.MaximumStreams(); i++)
+        {
+            if (heads[i] == firstSector)
+            {
+                heads[i] = ~0u;
+            }
+        }
+    }
+
+    for (f.addr = NextSector(firstSector); f.addr != lastSector; f.addr = NextSector(f.addr))
+    {
+        await(GetSectorInfo, f.addr, f.si);
+        async_yield();
+        if (f.si.IsValid())
+        {
+            firstSector = f.addr;
+            MYDBG("Moved first sector to %X - %d, it is going to be overwritten", f.addr, f.si.sequence);
+            async_return(true);
+        }
+    }
+
+    // if we didn't find a new firstSector, just keep firstSector == lastSector
+    firstSector = lastSector;
+    MYTRACE(1, "No valid first sector, keeping at %X", firstSector);
+}
+async_end
+
+async(JournalStorage::NewSector)
+async_def()
+{
+    if (freeOffset)
+    {
+        await(AdvanceSector);
+    }
+
+    for (;;)
+    {
+        while (preEraseTarget == lastSector)
+        {
+            // wait for the background erase of the sector to finish
+            async_yield();
+        }
+
+        if (lastPreErased)
+        {
+            MYTRACE(2, "Using pre-erased sector @ %X", lastSector);
+            lastPreErased = false;
+        }
+        else if (!await(IsSectorErased, lastSector))
         {
             MYTRACE(1, "Erasing sector @ %X", lastSector);
-            await(storage.Erase, lastSector, storage.SectorSize());
+            await(EraseSector, lastSector);
         }
 
+        TableSetEmpty(lastSector);
         await(format.InitSector, storage.SectorSpan(lastSector), last);
+        TableSet(lastSector, last);
         if (!last.IsValid())
         {
             MYDBG("failed to initialize sector %X", lastSector);
@@ -352,19 +1126,217 @@ async_def()
         else
         {
             freeOffset = last.firstRecord;
+            storage.Stats().rollovers++;
             MYTRACE(1, "Successfully initialized new sector @ %X - %d", lastSector, last.sequence);
+
+            if (compact && !compacting && firstSector != lastSector && NextSector(lastSector) == firstSector)
+            {
+                // the oldest sector is next to be reclaimed
+                await(Compact);
+            }
             async_return(true);
         }
     }
 }
 async_end
 
-async(JournalStorage::Write, Span data)
+async(JournalStorage::IsSectorErased, uint32_t addr)
+async_def(
+    size_t offset;
+)
+{
+    if (!(f.offset = format.EraseCounterOffset()))
+    {
+        async_return(await(storage.IsEmpty, addr, storage.SectorSize()));
+    }
+
+    if (!await(storage.IsEmpty, addr, f.offset))
+    {
+        async_return(false);
+    }
+
+    f.offset += sizeof(uint32_t);
+    async_return(await(storage.IsEmpty, addr + f.offset, storage.SectorSize() - f.offset));
+}
+async_end
+
+async(JournalStorage::EraseSector, uint32_t addr)
+async_def(
+    uint32_t count;
+)
+{
+    if (format.EraseCounterOffset())
+    {
+        f.count = await(ReadEraseCount, addr);
+    }
+
+    await(storage.Erase, addr, storage.SectorSize());
+
+    if (format.EraseCounterOffset())
+    {
+        // if power fails before the counter is programmed, the sector starts counting from zero again
+        f.count++;
+        await(storage.Write, addr + format.EraseCounterOffset(), f.count);
+    }
+}
+async_end
+
+async(JournalStorage::ReadEraseCount, uint32_t addr)
+async_def(
+    uint32_t count;
+)
+{
+    if (!format.EraseCounterOffset())
+    {
+        async_return(0);
+    }
+
+    await(storage.Read, storage.SectorAddress(addr) + format.EraseCounterOffset(), f.count);
+    async_return(f.count == ~0u ? 0 : f.count);
+}
+async_end
+
+async(JournalStorage::ReadWear, WearStats& wear)
+async_def(
+    uint32_t addr;
+    uint32_t count;
+)
+{
+    wear = {};
+    wear.minErases = ~0u;
+
+    if (format.EraseCounterOffset())
+    {
+        for (f.addr = 0; f.addr < storage.Size(); f.addr += storage.SectorSize())
+        {
+            await(storage.Read, f.addr + format.EraseCounterOffset(), f.count);
+            if (f.count == ~0u)
+            {
+                // never erased with counting enabled
+                continue;
+            }
+
+            wear.sectors++;
+            wear.minErases = std::min(wear.minErases, f.count);
+            wear.maxErases = std::max(wear.maxErases, f.count);
+            wear.totalErases += f.count;
+        }
+    }
+
+    if (!wear.sectors)
+    {
+        wear.minErases = 0;
+    }
+
+    async_return(wear.sectors);
+}
+async_end
+
+async(JournalStorage::PreErase, size_t count)
+async_def()
+{
+    while (preErased < count && preEraseTarget == ~0u)
+    {
+        preEraseTarget = SectorAfter(lastSector, preErased + 1);
+        if (preEraseTarget == lastSector)
+        {
+            // never erase the whole ring
+            preEraseTarget = ~0u;
+            break;
+        }
+
+        if (preEraseTarget == firstSector)
+        {
+            if (compact)
+            {
+                // the oldest sector must be compacted first
+                preEraseTarget = ~0u;
+                break;
+            }
+            await(DropFirstSector);
+        }
+
+        if (!await(IsSectorErased, preEraseTarget))
+        {
+            MYTRACE(1, "Pre-erasing sector @ %X", preEraseTarget);
+            await(EraseSector, preEraseTarget);
+        }
+        TableSetEmpty(preEraseTarget);
+
+        if (preEraseTarget == SectorAfter(lastSector, preErased + 1))
+        {
+            preErased++;
+        }
+        // otherwise lastSector has moved to the sector in the meantime and NewSector
+        // is waiting to check it has been erased
+        preEraseTarget = ~0u;
+    }
+
+    async_return(preErased);
+}
+async_end
+
+void JournalStorage::StartPreErase(size_t count, unsigned intervalMs)
+{
+    preEraseCount = count;
+    preEraseInterval = intervalMs;
+    if (count && !preEraseTask)
+    {
+        preEraseTask = true;
+        kernel::Task::Run(*this, &JournalStorage::PreEraseTask);
+    }
+}
+
+async(JournalStorage::PreEraseTask)
+async_def()
+{
+    while (preEraseCount)
+    {
+        if (preErased < preEraseCount)
+        {
+            await(PreErase, preEraseCount);
+        }
+        async_delay_ms(preEraseInterval);
+    }
+
+    preEraseTask = false;
+}
+async_end
+
+async(JournalStorage::Write, Span data, unsigned stream)
 async_def(
     RecordWriter rw;
+    uint8_t header[HEADER_MAX];
+    ByteStorage::WriteSegment seg[2];
+    JournalFormat::RecordInfo ri;
+    intptr_t payloadOffset;
 )
 {
-    if (!await(BeginWrite, f.rw, data.Length()))
+    if (freeOffset > 0 && freeOffset < storage.SectorSize())
+    {
+        if (!StreamMarked(stream))
+        {
+            await(MarkStream, stream);
+        }
+
+        // prepare the header in memory to write it together with the payload
+        f.ri.stream = stream;
+        f.payloadOffset = format.PrepareRecord(storage.RestOfSectorSpan(lastSector + freeOffset), Buffer(f.header, sizeof(f.header)), f.ri, data.Length());
+        if (f.payloadOffset > 0 && size_t(f.payloadOffset) <= sizeof(f.header) &&
+            f.ri.IsValid() && f.ri.PayloadLength() == data.Length())
+        {
+            f.seg[0] = { lastSector + freeOffset, Span(f.header, f.payloadOffset) };
+            f.seg[1] = { lastSector + freeOffset + f.payloadOffset, data };
+            freeOffset += f.ri.nextRecord;
+            maxRecord = std::max(0, int(storage.SectorSize() - freeOffset - f.payloadOffset));
+            lastRecord = f.seg[1].addr;
+            await(storage.WriteV, f.seg, 2);
+            await(format.CommitRecord, storage.GetSpan(f.seg[1].addr, data.Length()));
+            async_return(true);
+        }
+    }
+
+    if (!await(BeginWrite, f.rw, data.Length(), stream))
     {
         async_return(false);
     }
@@ -376,6 +1348,288 @@ async_def(
 async_end
 
 
+async(JournalStorage::WriteFromPipe, io::PipeReader pipe, size_t length, Timeout timeout, unsigned stream)
+async_def(
+    RecordWriter rw;
+    size_t written;
+)
+{
+    if (!await(BeginWrite, f.rw, length, stream))
+    {
+        async_return(0);
+    }
+
+    f.written = await(f.rw.WriteFromPipe, pipe, 0, f.rw.Size(), timeout);
+    if (f.written == f.rw.Size())
+    {
+        await(EndWrite, f.rw);
+    }
+    else
+    {
+        MYDBG("Incomplete record from pipe (%d/%d), not committing", f.written, f.rw.Size());
+    }
+    async_return(f.written);
+}
+async_end
+
+async(JournalStorage::WriteBatch, const Span* records, size_t count, Buffer buffer, unsigned stream, uint32_t* addresses)
+async_def(
+    size_t done, n, used, payloadOffset;
+    ByteStorage::WriteSegment commits[WRITE_BATCH];
+)
+{
+    while (f.done < count)
+    {
+        if (freeOffset == 0 || freeOffset >= storage.SectorSize())
+        {
+            if (compacting)
+            {
+                // relocated records must fit in the current sector
+                break;
+            }
+            await(NewSector);
+            ASSERT(freeOffset > 0 && freeOffset < storage.SectorSize());
+        }
+
+        if (!StreamMarked(stream))
+        {
+            await(MarkStream, stream);
+        }
+
+        f.used = LayoutBatch(records + f.done, std::min(count - f.done, size_t(WRITE_BATCH)), buffer, NULL, f.n, f.payloadOffset, stream, addresses ? addresses + f.done : NULL);
+        if (!f.n)
+        {
+            // the next record cannot be batched
+            if (!await(Write, records[f.done], stream))
+            {
+                break;
+            }
+            if (addresses)
+            {
+                addresses[f.done] = lastRecord;
+            }
+            f.done++;
+            continue;
+        }
+
+        MYTRACE(2, "Writing batch of %d records @ %X", f.n, lastSector + freeOffset);
+        await(storage.Write, lastSector + freeOffset, buffer.Left(f.used));
+        LayoutBatch(records + f.done, f.n, buffer, f.commits, f.n, f.payloadOffset, stream, NULL);
+        await(storage.WriteV, f.commits, f.n);
+
+        freeOffset += f.used;
+        maxRecord = std::max(0, int(storage.SectorSize() - freeOffset - f.payloadOffset));
+        f.done += f.n;
+    }
+
+    async_return(f.done);
+}
+async_end
+
+size_t JournalStorage::LayoutBatch(const Span* records, size_t count, Buffer buffer, ByteStorage::WriteSegment* commits, size_t& n, size_t& lastPayloadOffset, unsigned stream, uint32_t* addresses)
+{
+    JournalFormat::RecordInfo ri;
+    size_t used = 0;
+
+    for (n = 0; n < count && freeOffset + used < storage.SectorSize(); n++)
+    {
+        Buffer rec = buffer.RemoveLeft(used);
+        ri.stream = stream;
+        intptr_t payloadOffset = format.PrepareRecord(storage.RestOfSectorSpan(lastSector + freeOffset + used), rec, ri, records[n].Length());
+        if (payloadOffset < 0 || !ri.IsValid() ||
+            ri.PayloadLength() != records[n].Length() || ri.NextRecordOffset() > rec.Length())
+        {
+            // record would be truncated or does not fit
+            break;
+        }
+
+        auto p = (uint8_t*)rec.Pointer();
+        if (commits)
+        {
+            // the record prepared in the first pass is still in the buffer,
+            // only the header carries the commit bits, the rest stays 0xFF
+            format.PrepareCommit(rec.Left(ri.NextRecordOffset()), ri);
+            commits[n] = { lastSector + freeOffset + used, Span(p, payloadOffset) };
+        }
+        else
+        {
+            lastRecord = lastSector + freeOffset + used + payloadOffset;
+            if (addresses)
+            {
+                addresses[n] = lastRecord;
+            }
+            memcpy(p + payloadOffset, records[n].Pointer(), records[n].Length());
+            memset(p + payloadOffset + records[n].Length(), 0xFF, ri.NextRecordOffset() - payloadOffset - records[n].Length());
+        }
+
+        used += ri.NextRecordOffset();
+        lastPayloadOffset = payloadOffset;
+    }
+
+    return used;
+}
+
+async(JournalStorage::MarkStream, unsigned stream)
+async_def()
+{
+    ASSERT(stream < format.MaximumStreams());
+    await(format.MarkStream, storage.SectorSpan(lastSector), last, stream);
+    if (heads)
+    {
+        heads[stream] = lastSector;
+    }
+}
+async_end
+
+void JournalStorage::EnableCompaction(RecordCallback retention, Buffer buffer, RelocationCallback relocated)
+{
+    if (!compact)
+    {
+        compact = new CompactState();
+    }
+    compact->retention = retention;
+    compact->relocated = relocated;
+    compact->buffer = buffer;
+}
+
+async(JournalStorage::Compact)
+async_def(
+    RecordEnumerator re;
+    Buffer read;
+    RecordWriter rw;
+    uint32_t big;
+    size_t offset;
+)
+{
+    MYTRACE(1, "Compacting sector %X into %X", firstSector, lastSector);
+    compacting = true;
+    f.read = compact->buffer.Left(compact->buffer.Length() / 2);
+    EnumerateRecords(f.re, Sector(firstSector));
+
+    for (;;)
+    {
+        compact->count = compact->staged = 0;
+        if (compact->deferred)
+        {
+            // the record that did not fit in the stage of the previous batch
+            compact->deferred = false;
+            await(ReadRecord, f.re, f.read);
+            StageRecord(f.re, f.read.Left(f.re.Length()));
+        }
+
+        await(ReadRecords, f.re, f.read, GetDelegate(this, &JournalStorage::CompactRecord));
+        if (compact->count && !await(CompactFlush))
+        {
+            break;
+        }
+
+        if (compact->count == COMPACT_BATCH || compact->deferred)
+        {
+            // stopped by a full batch
+            continue;
+        }
+
+        if (!f.re.Oversized())
+        {
+            // end of sector, the enumerator is not positioned at a record
+            break;
+        }
+
+        // record too large for the buffer, copy it in parts
+        f.big = f.re.Address();
+        await(ReadRecord, f.re, f.read);
+        if (!compact->retention(f.re, f.read))
+        {
+            continue;
+        }
+
+        if (!await(BeginWrite, f.rw, f.re.Length(), f.re.Stream()))
+        {
+            break;
+        }
+
+        for (f.offset = 0; f.offset < f.rw.Size(); f.offset += f.read.Length())
+        {
+            await(ReadRecord, f.re, f.read, f.offset);
+            await(f.rw.Write, f.offset, f.read.Left(f.rw.Size() - f.offset));
+        }
+        await(EndWrite, f.rw);
+        if (compact->relocated)
+        {
+            compact->relocated(f.big, f.rw.Offset(), Span());
+        }
+    }
+
+    compacting = false;
+}
+async_end
+
+bool JournalStorage::CompactRecord(const RecordEnumerator& re, Span data)
+{
+    if (!compact->retention(re, data))
+    {
+        return true;
+    }
+
+    if (compact->staged + data.Length() > compact->buffer.Length() - compact->buffer.Length() / 2)
+    {
+        // stage full, the record is read again after the batch is written
+        compact->deferred = true;
+        return false;
+    }
+
+    // stop when the batch is full, the records are written before reading more
+    return StageRecord(re, data);
+}
+
+bool JournalStorage::StageRecord(const RecordEnumerator& re, Span data)
+{
+    // the read buffer is overwritten when ReadRecords reads the next chunk,
+    // the payloads are kept in the second half of the buffer until written
+    Buffer copy = compact->buffer.RemoveLeft(compact->buffer.Length() / 2 + compact->staged).Left(data.Length());
+    memcpy(copy.Pointer(), data.Pointer(), copy.Length());
+    compact->staged += copy.Length();
+
+    compact->records[compact->count] = copy;
+    compact->streams[compact->count] = re.Stream();
+    compact->sources[compact->count] = re.Address();
+    return ++compact->count < COMPACT_BATCH;
+}
+
+async(JournalStorage::CompactFlush)
+async_def(
+    Buffer write;
+    size_t i, n, written;
+)
+{
+    // the payloads are staged, the read half is free for laying out the batches
+    f.write = compact->buffer.Left(compact->buffer.Length() / 2);
+
+    while (f.i < compact->count)
+    {
+        for (f.n = 1; f.i + f.n < compact->count && compact->streams[f.i + f.n] == compact->streams[f.i]; f.n++);
+
+        f.written = await(WriteBatch, compact->records + f.i, f.n, f.write, compact->streams[f.i], compact->targets + f.i);
+        if (compact->relocated)
+        {
+            for (size_t i = 0; i < f.written; i++)
+            {
+                compact->relocated(compact->sources[f.i + i], compact->targets[f.i + i], compact->records[f.i + i]);
+            }
+        }
+
+        if (f.written < f.n)
+        {
+            MYDBG("Sector %X full, dropping the remaining live records", lastSector);
+            async_return(false);
+        }
+        f.i += f.n;
+    }
+
+    async_return(true);
+}
+async_end
+
 async(JournalStorage::CloseSector)
 async_def()
 {
@@ -10,6 +10,8 @@
 
 #include <kernel/kernel.h>
 
+#include <base/Delegate.h>
+
 #include <storage/ByteStorage.h>
 #include <storage/JournalFormat.h>
 
@@ -24,6 +26,12 @@ class JournalStorage
 public:
     JournalStorage(ByteStorage& storage, JournalFormat& format)
         : storage(storage), format(format) {}
+    ~JournalStorage() { delete[] table; delete[] heads; delete compact; }
+
+    enum
+    {
+        AnyStream = 0xFF,   //< enumerator stream filter accepting records of all streams
+    };
 
 #if TRACE
     virtual const char* DebugComponent() const { return "JournalStorage"; }
@@ -59,16 +67,18 @@ public:
     class SectorEnumerator
     {
     public:
-        SectorEnumerator() : s(~0u) {}
+        SectorEnumerator(uint8_t stream = AnyStream) : s(~0u), stream(stream) {}
 
         operator Sector() const { return s; }
 
         constexpr bool IsValid() const { return s.IsValid(); }
         constexpr operator bool() const { return IsValid(); }
         constexpr uint32_t Address() const { return s.addr; }
+        constexpr unsigned Stream() const { return stream; }
 
     private:
         Sector s;
+        uint8_t stream;
 
         friend class JournalStorage;
     };
@@ -92,19 +102,37 @@ public:
         constexpr bool IsEmpty() const { return r.addr == rNext.addr; }
         constexpr uint32_t Address() const { return r.addr; }
         constexpr uint32_t Length() const { return len; }
+        //! Gets the stream of the current record
+        constexpr unsigned Stream() const { return recordStream; }
+        //! Checks if @ref ReadRecords stopped at a record with a payload larger than its buffer
+        constexpr bool Oversized() const { return oversized; }
 
     private:
-        RecordEnumerator(const Sector& s)
-            : r(s.addr), rNext(s.addr), si({}) {}
+        RecordEnumerator(const Sector& s, uint8_t stream)
+            : r(s.addr), rNext(s.addr), si({}), stream(stream) {}
 
         Record r;
         Record rNext;
-        uint32_t len;
+        uint32_t len = 0;
         JournalFormat::SectorInfo si;
+        uint8_t stream = AnyStream;
+        uint8_t recordStream = 0;
+        bool oversized = false;
+        //! Bytes of the current record (including the frame) already streamed by @ref ReadRecordsToPipe
+        uint32_t streamed = 0;
+        //! Verification state of the payload streamed so far, see @ref JournalFormat::UpdateVerification
+        uint32_t verification = 0;
 
         friend class JournalStorage;
     };
 
+    //! Serializable position in the journal, remains valid across reboots until the sector is overwritten
+    struct Cursor
+    {
+        uint32_t sequence;  //< sequence number of the sector
+        uint32_t offset;    //< offset of the next record in the sector
+    };
+
     class RecordWriter : public ByteStorageSpan
     {
     private:
@@ -118,19 +146,111 @@ public:
 
     //! Scans the journal storage, determining the first, last, and next valid record
     async(Scan);
+    //! Scans the journal storage using a binary search over sector sequence numbers
+    /*!
+     * Only a logarithmic number of sector headers is read, assuming the sectors
+     * were written in ring order without any bad sectors. Falls back to a full
+     * @ref Scan when the sector sequence does not match the expected layout.
+     * @returns true if the fast scan succeeded, false if a full scan was performed
+     */
+    async(FastScan);
     //! Begins writing a new record allocating a span of the requested length
-    async(BeginWrite, RecordWriter& writer, size_t length);
+    /*!
+     * @param stream selects the stream of the record, for formats supporting
+     * multiple streams (see @ref JournalFormat::MaximumStreams)
+     */
+    async(BeginWrite, RecordWriter& writer, size_t length, unsigned stream = 0);
     //! Finishes writing a record, marking it as valid
     async(EndWrite, RecordWriter& writer) { return async_forward(format.CommitRecord, writer); }
     //! Writes a new record to the journal
-    async(Write, Span record);
+    async(Write, Span record, unsigned stream = 0);
+    //! Writes multiple records to the journal, programming as many of them together as possible
+    /*!
+     * Records are laid out in @param buffer together with their (uncommitted) headers
+     * and written at once, followed by a single write committing all of them,
+     * which programs only the record headers.
+     * Each record remains individually committed, so a crash cannot produce
+     * a partially written valid record. Records that cannot be batched
+     * (e.g. the format does not support it, or the record is larger than
+     * @param buffer) are written one by one.
+     * If @param addresses is provided, it receives the payload address of each written record.
+     * @returns the number of records written
+     */
+    async(WriteBatch, const Span* records, size_t count, Buffer buffer, unsigned stream = 0, uint32_t* addresses = NULL);
+    //! Writes a new record to the journal with the payload read from an I/O pipe
+    /*!
+     * The record is committed only if the complete payload has been received,
+     * otherwise it is left invalid.
+     * @returns the number of payload bytes written, which can be less than @param length
+     * if the record does not fit in a sector or the pipe times out
+     */
+    async(WriteFromPipe, io::PipeReader pipe, size_t length, Timeout timeout = Timeout::Infinite, unsigned stream = 0);
+    //! Pushes records buffered by the underlying storage to the medium
+    /*!
+     * Records written to a buffering storage (e.g. @ref BufferedSPIFlashStorage)
+     * are only durable after this or @ref ByteStorage::Sync completes. Buffered
+     * records reach the medium in the order they were written.
+     */
+    async(Flush) { return async_forward(storage.Flush); }
     //! Gets the maximum record size in the current sector
     size_t MaximumRecord() const { return maxRecord; }
     //! Closes the current sector and starts writing a new one
     async(CloseSector);
+    //! Makes sure up to the specified number of sectors following the last sector are erased
+    //! @returns the number of erased sectors ready to be used
+    async(PreErase, size_t count);
+    //! Starts a background task keeping the specified number of sectors erased ahead of the last sector
+    void StartPreErase(size_t count, unsigned intervalMs = 100);
+    //! Gets the number of erased sectors ready to be used for new records
+    size_t PreErasedSectors() const { return preErased; }
+
+    //! Wear statistics collected from the erase counters of the sectors
+    struct WearStats
+    {
+        uint32_t sectors;       //!< number of sectors with a valid erase counter
+        uint32_t minErases;     //!< lowest erase count of a sector
+        uint32_t maxErases;     //!< highest erase count of a sector
+        uint64_t totalErases;   //!< sum of the erase counts of all sectors
+    };
 
-    //! Enumerates all sectors with records
-    void EnumerateSectors(SectorEnumerator& e) { e = SectorEnumerator(); }
+    //! Reads the erase counter of the specified sector
+    //! @returns the number of times the sector was erased, 0 if unknown or the format does not count erases
+    async(ReadEraseCount, uint32_t addr);
+    //! Collects wear statistics from the erase counters of all sectors
+    /*!
+     * Requires a format with erase counters (see @ref JournalFormat::EraseCounterOffset),
+     * reads one counter per sector. Comparing @ref WearStats::maxErases against the rated
+     * endurance of the medium predicts its end of life.
+     */
+    async(ReadWear, WearStats& wear);
+
+    //! Enables the RAM-resident table of sector states, must be called before @ref Scan
+    /*!
+     * The table keeps the state and the low bits of the sequence number of each sector,
+     * (two bytes per sector) so enumerators can skip between sectors without reading
+     * sector headers from storage. It requires all valid sectors to share the same
+     * record layout (first record offset and fixed record size).
+     * @returns false if the storage has too many sectors for the table
+     */
+    bool EnableSectorTable();
+    //! Enables tracking of the last sector containing each stream, must be called before @ref Scan
+    /*!
+     * The heads of all streams are recovered by a single @ref Scan from the stream
+     * bitmaps in sector headers (four bytes per stream). @ref FastScan does not read
+     * all sector headers and falls back to a full @ref Scan when heads are tracked.
+     * @returns false if the format does not support multiple streams
+     */
+    bool EnableStreamHeads();
+    //! Positions the enumerator at the last sector containing records of the specified stream
+    /*!
+     * The enumerator is filtered to the stream, so @ref PreviousSector continues
+     * with older sectors containing the stream.
+     * @returns false if stream heads are not tracked or there are no records of the stream
+     */
+    bool StreamHead(SectorEnumerator& e, unsigned stream) const;
+
+    //! Enumerates all sectors with records, or only those containing records of @param stream
+    void EnumerateSectors(SectorEnumerator& e, unsigned stream = AnyStream) { e = SectorEnumerator(stream); }
     //! Moves the enumerator to the next valid sector
     async(NextSector, SectorEnumerator& e);
     //! Moves the enumerator to the previous valid sector
@@ -139,17 +259,104 @@ public:
     async(ReadSectorHeader, const SectorEnumerator& e, const Buffer& buf, size_t offset = 0);
 
     //! Enumerates the records in the specified sector
-    void EnumerateRecords(RecordEnumerator& e, Sector sector) { e = RecordEnumerator(sector); }
+    void EnumerateRecords(RecordEnumerator& e, Sector sector, unsigned stream = AnyStream) { e = RecordEnumerator(sector, stream); }
+    //! Enumerates the records of the stream of the sector enumerator in the specified sector
+    void EnumerateRecords(RecordEnumerator& e, const SectorEnumerator& se) { e = RecordEnumerator(se, se.stream); }
     //! Moves the enumerator to the next valid record
     async(NextRecord, RecordEnumerator& e);
     //! Reads part of the current record from the specified enumerator
     async(ReadRecord, const RecordEnumerator& e, const Buffer& buf, size_t offset = 0);
+    //! Gets the payload of the current record from the specified enumerator directly, without copying
+    //! @returns an empty span if the storage is not mapped (see @ref ByteStorage::GetDirectPointer)
+    Span MappedRecord(const RecordEnumerator& e) const
+    {
+        auto p = e.si.IsValid() && e.len ? storage.GetDirectPointer(e.r.addr, e.len) : NULL;
+        return p ? Span(p, e.len) : Span();
+    }
+    //! Positions the enumerator so the next call to @ref NextRecord returns the record in the specified slot of its sector
+    /*!
+     * Slots include bad records. For formats with fixed-size records the position is
+     * calculated directly, otherwise the preceding record headers are walked.
+     * @returns false if the sector does not contain the specified slot
+     */
+    async(SeekRecord, RecordEnumerator& e, size_t index);
+
+    //! Gets a cursor pointing after the current record of the enumerator
+    Cursor GetCursor(const RecordEnumerator& e) const { return { e.si.sequence, e.rNext.addr - storage.SectorAddress(e.r.addr) }; }
+    //! Positions the enumerators at the specified cursor
+    /*!
+     * The sector is located using its sequence number, calculated directly from
+     * the last sector if possible, otherwise using a binary search over the ring.
+     * @returns true if the position was found, false if it is no longer (or not yet)
+     * stored, in which case the enumerators are positioned at the first stored sector
+     */
+    async(Seek, SectorEnumerator& se, RecordEnumerator& re, Cursor cursor);
+
+    //! Callback receiving records read by @ref ReadRecords, returns false to stop enumeration
+    typedef Delegate<bool, const RecordEnumerator&, Span> RecordCallback;
+    //! Reads the remaining records of the enumerator sector in bulk
+    /*!
+     * The rest of the sector is read into @param buf in large chunks and records are
+     * parsed from memory, invoking @param callback with the enumerator positioned
+     * at each record and its complete payload.
+     * Enumeration stops at the end of the sector, when the callback returns false,
+     * or at a record with a payload larger than @param buf - in the last case
+     * the enumerator is left positioned at the record (without invoking the callback)
+     * and reports @ref RecordEnumerator::Oversized, so it can be read in parts using
+     * @ref ReadRecord.
+     * If the storage is mapped, records are parsed in place and the callback receives
+     * the payloads directly from storage, @param buf only limits the chunk size.
+     * @returns the number of records passed to the callback
+     */
+    async(ReadRecords, RecordEnumerator& e, Buffer buf, RecordCallback callback);
+    //! Callback notified about a record copied by compaction, receives the old and new payload address and the payload
+    typedef Delegate<void, uint32_t, uint32_t, Span> RelocationCallback;
+    //! Enables compaction, copying live records of the oldest sector forward before it is reclaimed
+    /*!
+     * When a new sector is started and only the oldest sector remains before the ring
+     * wraps, @param retention is invoked for each record in the oldest sector, and records
+     * for which it returns true are copied into the new sector (keeping their stream)
+     * using bulk reads and batched writes. @param buffer is split in half, the first half
+     * is used for reading and laying out the batches, the second half holds copies
+     * of the retained payloads until they are written. Records larger than half of it
+     * are passed to the callback truncated and copied in parts.
+     * Copying stops when the new sector is full, the remaining records are lost with the
+     * oldest sector. The copies are new records - until the oldest sector is reclaimed,
+     * enumeration returns both the originals and the copies. Pre-erasing never erases
+     * the oldest sector while compaction is enabled. @param relocated is notified about
+     * each copied record (except oversized ones copied in parts, which are reported with an empty payload).
+     */
+    void EnableCompaction(RecordCallback retention, Buffer buffer, RelocationCallback relocated = RelocationCallback());
+    //! Reads part of the current record from the specified enumerator directly into an I/O pipe
+    async(ReadRecordToPipe, const RecordEnumerator& e, io::PipeWriter pipe, size_t offset = 0, Timeout timeout = Timeout::Infinite);
+
+    //! Callback producing an optional frame header (e.g. length prefix) for each record streamed by @ref ReadRecordsToPipe
+    //! @returns the number of bytes stored in the provided buffer
+    typedef Delegate<size_t, const RecordEnumerator&, Buffer> FrameCallback;
+    //! Streams all records following the current position of the enumerators directly into an I/O pipe
+    /*!
+     * Records are read from storage directly into the pipe buffers. Invalid enumerators
+     * start at the first stored record, enumerators positioned using @ref Seek resume
+     * from the cursor. If the pipe times out in the middle of a record, the enumerator is
+     * left positioned at the incomplete record and the next call continues streaming it
+     * from the first byte that was not written.
+     * If the format verifies records, the payloads are read through the pipe buffers
+     * and checksummed on their way, so each byte is still read only once. A corrupted
+     * record is detected only after it has been streamed, it is counted in
+     * @ref IOStats::badRecords and not included in the result.
+     * @returns the number of records streamed completely
+     */
+    async(ReadRecordsToPipe, SectorEnumerator& se, RecordEnumerator& re, io::PipeWriter pipe, FrameCallback framing = FrameCallback(), Timeout timeout = Timeout::Infinite);
 
     ByteStorage& storage;
     JournalFormat& format;
 
     //! Returns the last written sector information
     const uint32_t LastSectorAddress() const { return lastSector; }
+    //! Returns the payload address of the last record written (or started using @ref BeginWrite)
+    uint32_t LastRecordAddress() const { return lastRecord; }
+    //! Checks if the specified storage address is in a sector still belonging to the journal
+    bool IsStored(uint32_t addr) const { return SectorDistance(firstSector, storage.SectorAddress(addr)) <= SectorDistance(firstSector, lastSector); }
     //! Returns the last written sector information
     const JournalFormat::SectorInfo& LastSector() const { return last; }
 
@@ -157,15 +364,120 @@ private:
     JournalFormat::SectorInfo last = {};
     uint32_t firstSector = 0, lastSector = 0;
     uint32_t freeOffset = 0, maxRecord = 0;
+    uint32_t lastRecord = 0;
+    size_t preErased = 0, preEraseCount = 0;
+    uint32_t preEraseTarget = ~0u;
+    unsigned preEraseInterval = 0;
+    bool lastPreErased = false;
+    //! Set while the background pre-erase task is running
+    bool preEraseTask = false;
+    uint16_t* table = NULL;
+    uint32_t* heads = NULL;
+
+    enum
+    {
+        COMPACT_BATCH = 8,  //< maximum number of records relocated by a single batched write
+        WRITE_BATCH = 16,   //< maximum number of records programmed by a single batched write
+    };
+
+    struct CompactState
+    {
+        RecordCallback retention;
+        RelocationCallback relocated;
+        Buffer buffer;
+        size_t count, staged;
+        bool deferred;
+        Span records[COMPACT_BATCH];
+        uint8_t streams[COMPACT_BATCH];
+        uint32_t sources[COMPACT_BATCH];
+        uint32_t targets[COMPACT_BATCH];
+    };
+
+    CompactState* compact = NULL;
+    bool compacting = false;
+    JournalFormat::SectorInfo tableLayout = {};
+
+    enum
+    {
+        TABLE_UNKNOWN = 0,
+        TABLE_BAD = 1,
+        TABLE_EMPTY = 2,
+        TABLE_VALID = 3,
+        TABLE_STATE_MASK = 3,
+        TABLE_SEQ_SHIFT = 2,
+        TABLE_SEQ_MASK = 0x3FFF,
+    };
+
+    //! Records the state of a sector in the sector table
+    void TableSet(uint32_t addr, const JournalFormat::SectorInfo& si);
+    //! Records that a sector has been erased in the sector table
+    void TableSetEmpty(uint32_t addr) { if (table) { table[addr >> storage.SectorSizeBits()] = TABLE_EMPTY; } }
+    //! Checks if the sector may contain records of the specified stream
+    bool HasStream(const JournalFormat::SectorInfo& si, unsigned stream) const
+        { return stream == AnyStream || format.MaximumStreams() <= 1 || (si.streams & (1u << stream)); }
+    //! Checks if the last sector is already marked as containing the specified stream
+    bool StreamMarked(unsigned stream) const
+        { return format.MaximumStreams() <= 1 || (last.streams & (1u << stream)); }
+    //! Marks the stream as present in the last sector before writing its first record there
+    async(MarkStream, unsigned stream);
+    //! Records the sector as the head of the streams present in it that don't have a head yet
+    void SetStreamHeads(uint32_t addr, const JournalFormat::SectorInfo& si);
+    //! Retrieves sector information from the sector table, or scans the sector if not known
+    async(GetSectorInfo, uint32_t addr, JournalFormat::SectorInfo& si);
+    enum
+    {
+        FRAME_MAX = 16,     //< maximum frame header size produced by FrameCallback
+        HEADER_MAX = 16,    //< maximum record header size prepared in memory by Write
+    };
+
+    //! Writes data into an I/O pipe
+    async(WriteToPipe, io::PipeWriter pipe, Span data, Timeout timeout);
+    //! Streams part of the current record payload into an I/O pipe, updating its verification state
+    async(ReadVerifiedToPipe, RecordEnumerator& re, io::PipeWriter pipe, size_t offset, Timeout timeout);
+
+    enum struct ParseResult
+    {
+        More,       //< records continue beyond the parsed data
+        Stop,       //< enumeration finished
+        Fallback,   //< the record at the start of the data cannot be parsed from memory
+    };
 
+    //! Parses records from a chunk of sector data for @ref ReadRecords
+    ParseResult ParseRecords(RecordEnumerator& re, Span chunk, uint32_t base, const RecordCallback& callback, size_t& count);
+    //! Lays out a batch of records in the buffer, either the records themselves or their commit mask
+    //! @param commits receives the header segment of each record when laying out the commit mask
+    size_t LayoutBatch(const Span* records, size_t count, Buffer buffer, ByteStorage::WriteSegment* commits, size_t& n, size_t& lastPayloadOffset, unsigned stream, uint32_t* addresses);
+    //! Finds the free space in the last sector by walking its records
+    async(FindFreeOffset);
     //! Advances lastSector to a new sector, adjusting firstSector as necessary
     async(AdvanceSector);
+    //! Moves firstSector to the next valid sector, because it is about to be overwritten
+    async(DropFirstSector);
+    //! Background task keeping sectors erased ahead of lastSector
+    async(PreEraseTask);
+    //! Checks if a sector is erased, ignoring its erase counter
+    async(IsSectorErased, uint32_t addr);
+    //! Erases a sector, carrying its erase counter over
+    async(EraseSector, uint32_t addr);
     //! Allocates a new sector
     async(NewSector);
+    //! Copies the live records of the oldest sector to the last sector
+    async(Compact);
+    //! Collects records passed to @ref ReadRecords by @ref Compact
+    bool CompactRecord(const RecordEnumerator& re, Span data);
+    //! Copies a record collected by @ref CompactRecord into the compaction stage
+    bool StageRecord(const RecordEnumerator& re, Span data);
+    //! Writes the collected records, in runs of the same stream
+    //! @returns false if the last sector is full
+    async(CompactFlush);
     //! Gets the address of the previous sector in a ring
     uint32_t PreviousSector(uint32_t addr) const { return nonzero(addr, storage.Size()) - storage.SectorSize(); }
     //! Gets the address of the next sector in a ring
     uint32_t NextSector(uint32_t addr) const { addr += storage.SectorSize(); return addr == storage.Size() ? 0 : addr; }
+    //! Gets the address of the sector the specified number of sectors after the specified one in a ring
+    uint32_t SectorAfter(uint32_t addr, size_t n) const { return uint32_t((addr + uint64_t(n) * storage.SectorSize()) % storage.Size()); }
+    //! Gets the number of sectors between two sectors in a ring
+    size_t SectorDistance(uint32_t from, uint32_t to) const { return ((to + storage.Size() - from) % storage.Size()) >> storage.SectorSizeBits(); }
 };
 
 }
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/MappedByteStorage.cpp
+ */
+
+#include "MappedByteStorage.h"
+
+namespace storage
+{
+
+async(MappedByteStorage::ReadImpl, uint32_t addr, void* buffer, size_t length)
+async_def()
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    memcpy(buffer, base + addr, length);
+}
+async_end
+
+async(MappedByteStorage::ReadToRegister, uint32_t addr, volatile void* reg, size_t length)
+async_def()
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    for (size_t i = 0; i < length; i++)
+    {
+        *(volatile uint8_t*)reg = base[addr + i];
+    }
+}
+async_end
+
+async(MappedByteStorage::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    size_t read;
+)
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, 0);
+
+    while (f.read < length)
+    {
+        if (!pipe.Available() && !await(pipe.Allocate, length - f.read, timeout))
+        {
+            break;
+        }
+
+        auto buf = pipe.GetBuffer().Left(length - f.read);
+        memcpy(buf.Pointer(), base + addr + f.read, buf.Length());
+        pipe.Advance(buf.Length());
+        f.read += buf.Length();
+        stats.op[IOStats::Read].bytes += buf.Length();
+    }
+
+    async_return(f.read);
+}
+async_end
+
+async(MappedByteStorage::WriteImpl, uint32_t addr, const void* buffer, size_t length)
+async_def(
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Write, length);
+    f.res = await(backend.Write, addr, Span(buffer, length));
+    // the window shows the new data only after the backend has completed the operation
+    await(backend.Sync);
+    async_return(f.res);
+}
+async_end
+
+async(MappedByteStorage::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Write, length);
+    f.res = await(backend.WriteFromPipe, pipe, addr, length, timeout);
+    await(backend.Sync);
+    async_return(f.res);
+}
+async_end
+
+async(MappedByteStorage::Fill, uint32_t addr, uint8_t value, size_t length)
+async_def(
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Write, length);
+    f.res = await(backend.Fill, addr, value, length);
+    await(backend.Sync);
+    async_return(f.res);
+}
+async_end
+
+async(MappedByteStorage::IsAll, uint32_t addr, uint8_t value, size_t length)
+async_def()
+{
+    ASSERT(addr <= Size());
+    ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Check, length);
+    async_return(Span(base + addr, length).IsAll(value));
+}
+async_end
+
+async(MappedByteStorage::Erase, uint32_t addr, uint32_t length)
+async_def(
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Erase, length);
+    f.res = await(backend.Erase, addr, length);
+    await(backend.Sync);
+    async_return(f.res);
+}
+async_end
+
+async(MappedByteStorage::EraseFirst, uint32_t addr, uint32_t length)
+async_def(
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Erase, SectorSize());
+    f.res = await(backend.EraseFirst, addr, length);
+    await(backend.Sync);
+    async_return(f.res);
+}
+async_end
+
+}
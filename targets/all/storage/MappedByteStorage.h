@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/MappedByteStorage.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/ByteStorage.h>
+
+namespace storage
+{
+
+//! ByteStorage on a medium mapped into the address space (internal flash, memory-mapped QSPI)
+/*!
+ * All reads are served directly from the mapped window, which also makes them
+ * available synchronously through @ref GetDirectPointer. Modifications are delegated
+ * to the @p backend storage (e.g. the flash controller driver), which must make
+ * them visible in the window (e.g. by invalidating caches) once they complete.
+ * Each modifying operation awaits @ref Sync of the backend before returning, so
+ * backends that complete writes in the background (e.g. @ref SPIFlash) never leave
+ * stale data visible through the window.
+ * Direct accesses are not counted in the statistics.
+ */
+class MappedByteStorage : public ByteStorage
+{
+public:
+    MappedByteStorage(const void* base, ByteStorage& backend)
+        : base((const uint8_t*)base), backend(backend) {}
+
+    //! Initializes the geometry, must be called after the backend is initialized
+    void Init() { Initialize(backend.Size(), backend.SectorSize()); }
+
+    const void* GetDirectPointer(uint32_t addr, size_t length) final override
+        { return addr <= Size() && addr + length <= Size() ? base + addr : NULL; }
+
+private:
+    const uint8_t* base;
+    ByteStorage& backend;
+
+    async(ReadImpl, uint32_t addr, void* buffer, size_t length) final override;
+    async(WriteImpl, uint32_t addr, const void* buffer, size_t length) final override;
+
+public:
+    async(ReadToRegister, uint32_t addr, volatile void* reg, size_t length) final override;
+    async(ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+
+    async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+    async(Fill, uint32_t addr, uint8_t value, size_t length) final override;
+
+    async(IsAll, uint32_t addr, uint8_t value, size_t length) final override;
+    async(Erase, uint32_t addr, uint32_t length) final override;
+    async(EraseFirst, uint32_t addr, uint32_t length) final override;
+    async(Flush) final override { return async_forward(backend.Flush); }
+    async(Sync) final override { return async_forward(backend.Sync); }
+};
+
+}
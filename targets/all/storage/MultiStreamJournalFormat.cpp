@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/MultiStreamJournalFormat.cpp
+ */
+
+#include "MultiStreamJournalFormat.h"
+
+using namespace storage;
+
+async(MultiStreamJournalFormat::ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const
+async_def(
+    PageHeader ph;
+)
+{
+    await(sector.Read, 0, f.ph);
+    info.firstRecord = sizeof(PageHeader);
+    info.sequence = f.ph.sequence;
+    info.streams = ~f.ph.streams;
+    if (Span(f.ph).IsAllOnes())
+    {
+        info.state = SectorState::Empty;
+    }
+    else if (f.ph.magic != magic)
+    {
+        info.state = SectorState::Bad;
+    }
+    else if (following != NULL && f.ph.sequence + 1 == following->sequence)
+    {
+        info.state = SectorState::ValidPreceding;
+    }
+    else
+    {
+        info.state = SectorState::Valid;
+    }
+}
+async_end
+
+void MultiStreamJournalFormat::ParseHeader(const RecordHeader& hdr, RecordInfo& info)
+{
+    info.payload = hdr.Size();
+    info.nextRecord = info.payload + sizeof(RecordHeader);
+    info.stream = hdr.stream;
+    if (hdr.IsEmpty())
+    {
+        info.state = RecordState::Empty;
+    }
+    else if (hdr.IsBad() || hdr.stream >= MAX_STREAMS)
+    {
+        info.state = RecordState::Bad;
+    }
+    else
+    {
+        info.state = RecordState::Valid;
+    }
+}
+
+async(MultiStreamJournalFormat::ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const
+async_def(
+    RecordHeader hdr;
+)
+{
+    await(sectorRemaining.Read, 0, f.hdr);
+    ParseHeader(f.hdr, info);
+    async_return(sizeof(RecordHeader));
+}
+async_end
+
+intptr_t MultiStreamJournalFormat::ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const
+{
+    RecordHeader hdr;
+    if (data.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    memcpy(&hdr, data.Pointer(), sizeof(hdr));
+    ParseHeader(hdr, info);
+    return sizeof(RecordHeader);
+}
+
+async(MultiStreamJournalFormat::InitSector, const ByteStorageSpan& sector, SectorInfo& info)
+async_def()
+{
+    info.sequence = (info.IsValid() ? info.sequence : 0) + 1;
+    await(sector.Write, offsetof(PageHeader, sequence), info.sequence);
+    await(sector.Write, offsetof(PageHeader, magic), magic);
+    info.firstRecord = sizeof(PageHeader);
+    info.streams = 0;
+    info.state = SectorState::Valid;
+}
+async_end
+
+async(MultiStreamJournalFormat::MarkStream, const ByteStorageSpan& sector, SectorInfo& info, unsigned stream)
+async_def(
+    uint32_t mask;
+)
+{
+    ASSERT(stream < MAX_STREAMS);
+    // programming can only clear bits, so the other streams remain untouched
+    f.mask = ~(1u << stream);
+    await(sector.Write, offsetof(PageHeader, streams), f.mask);
+    info.streams |= 1u << stream;
+    async_return(true);
+}
+async_end
+
+bool MultiStreamJournalFormat::MakeHeader(const ByteStorageSpan& sectorRemaining, RecordHeader& hdr, RecordInfo& info, size_t payload)
+{
+    ASSERT(info.stream < MAX_STREAMS);
+
+    // limit the payload to theoretical maximum
+    hdr.size = std::min(payload, size_t(0x7FFF));
+    hdr.stream = info.stream;
+    hdr.reserved = 0xFF;
+
+    if ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) == sizeof(PageHeader))
+    {
+        // further limit the payload to sector maximum
+        hdr.size = std::min(size_t(hdr.size), sectorRemaining.Size() - sizeof(RecordHeader));
+    }
+
+    if (sizeof(RecordHeader) + hdr.size > sectorRemaining.Size())
+    {
+        // sector is full, record won't fit
+        info.state = RecordState::Bad;
+        return false;
+    }
+
+    hdr.size |= 0x8000;   // mark as unfinished
+    info.payload = hdr.Size();
+    info.nextRecord = sizeof(RecordHeader) + info.payload;
+    info.state = RecordState::Valid;
+    return true;
+}
+
+async(MultiStreamJournalFormat::InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload)
+async_def(
+    RecordHeader hdr;
+)
+{
+    if (!MakeHeader(sectorRemaining, f.hdr, info, payload))
+    {
+        async_return(0);
+    }
+
+    await(sectorRemaining.Write, 0, f.hdr);
+    async_return(sizeof(RecordHeader));
+}
+async_end
+
+async(MultiStreamJournalFormat::CommitRecord, const ByteStorageSpan& payload)
+async_def()
+{
+    ASSERT(payload.Storage().IsSameSector(payload.Offset(), payload.Offset() - sizeof(RecordHeader)));
+    // just clear the top bit in the length field
+    await(payload.Storage().Write, payload.Offset() - sizeof(RecordHeader) + offsetof(RecordHeader, size), (const uint16_t[]){0x7FFF});
+}
+async_end
+
+intptr_t MultiStreamJournalFormat::PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload)
+{
+    RecordHeader hdr;
+    if (header.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    if (!MakeHeader(sectorRemaining, hdr, info, payload))
+    {
+        return 0;
+    }
+
+    memcpy(header.Pointer(), &hdr, sizeof(hdr));
+    return sizeof(RecordHeader);
+}
+
+void MultiStreamJournalFormat::PrepareCommit(Buffer record, const RecordInfo& info)
+{
+    // the same bits as CommitRecord, clearing the top bit in the length field
+    uint16_t size = 0x7FFF;
+    memset(record.Pointer(), 0xFF, info.NextRecordOffset());
+    memcpy((uint8_t*)record.Pointer() + offsetof(RecordHeader, size), &size, sizeof(size));
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/MultiStreamJournalFormat.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/JournalFormat.h>
+
+namespace storage
+{
+
+//! Variable-length journal format multiplexing up to 32 logical streams in a single ring
+/*!
+ * Each record carries its stream ID, the sector header contains a bitmap of streams
+ * present in the sector (programmed before the first record of each stream is written),
+ * so enumerators of a single stream skip sectors without its records.
+ */
+class MultiStreamJournalFormat : public JournalFormat
+{
+public:
+    MultiStreamJournalFormat(uint32_t magic)
+        : magic(magic) {}
+
+    enum
+    {
+        MAX_STREAMS = 32,
+    };
+
+private:
+    uint32_t magic;
+
+    struct PageHeader
+    {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t streams;   //< inverted bitmap of streams present in the sector
+    };
+
+    struct RecordHeader
+    {
+        uint16_t size;
+        uint8_t stream;
+        uint8_t reserved;
+
+        constexpr bool IsEmpty() const { return size == 0xFFFF; }
+        constexpr bool IsBad() const { return size & 0x8000; }
+        constexpr size_t Size() const { return size & 0x7FFF; }
+    };
+
+    //! Fills the record info from a record header
+    static void ParseHeader(const RecordHeader& hdr, RecordInfo& info);
+    //! Prepares the uncommitted header of a new record
+    static bool MakeHeader(const ByteStorageSpan& sectorRemaining, RecordHeader& hdr, RecordInfo& info, size_t payload);
+
+    virtual async(ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const final override;
+    virtual async(ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual intptr_t ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual async(InitSector, const ByteStorageSpan& sector, SectorInfo& info) final override;
+    virtual async(InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload) final override;
+    virtual async(CommitRecord, const ByteStorageSpan& payload) final override;
+    virtual intptr_t PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload) final override;
+    virtual void PrepareCommit(Buffer record, const RecordInfo& info) final override;
+    virtual unsigned MaximumStreams() const final override { return MAX_STREAMS; }
+    virtual async(MarkStream, const ByteStorageSpan& sector, SectorInfo& info, unsigned stream) final override;
+};
+
+}
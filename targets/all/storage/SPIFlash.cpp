@@ -60,10 +60,22 @@ static struct
 namespace storage
 {
 
-SPIFlash::SPIFlash(bus::SPI spi, GPIOPin cs, size_t cachePages)
-    : spi(spi), cs(spi.GetChipSelect(cs)), cachePages(cachePages)
+SPIFlash::SPIFlash(bus::SPI spi, GPIOPin cs, size_t cacheLines, unsigned cacheLineBits, size_t cacheWays)
+    : spi(spi), cs(spi.GetChipSelect(cs)), cacheLines(cacheLines), cacheWays(nonzero(cacheWays, cacheLines)), cacheLineBits(cacheLineBits)
 {
-    cache = cachePages ? new Cache[cachePages] : NULL;
+    ASSERT(cacheLines && !(cacheLines % this->cacheWays));
+    cacheSetMask = cacheLines / this->cacheWays - 1;
+    ASSERT(!(cacheSetMask & (cacheSetMask + 1)));
+
+    cache = new Cache[cacheLines];
+    cacheData = new char[cacheLines << cacheLineBits];
+    for (size_t i = 0; i < cacheLines; i++)
+    {
+        cache[i].data = cacheData + (i << cacheLineBits);
+    }
+    scratch = new uint32_t[SCRATCH_SIZE / sizeof(uint32_t)];
+    // until SFDP is read, assume the longest release time of common devices
+    releaseDelay = mono_t(uint64_t(30) * MONO_FREQUENCY / 1000000) + 1;
 #if SPI_FLASH_DIAG_STATS
     kernel::Task::Run(l_stats, &decltype(l_stats)::Dump);
 #endif
@@ -72,13 +84,44 @@ SPIFlash::SPIFlash(bus::SPI spi, GPIOPin cs, size_t cachePages)
 SPIFlash::~SPIFlash()
 {
     delete[] cache;
+    delete[] cacheData;
+    delete[] scratch;
+}
+
+void SPIFlash::EnablePowerDown(unsigned idleMs)
+{
+    powerDownIdle = opPowerDown ? idleMs : 0;
+    if (powerDownIdle && !powerDownTask)
+    {
+        // the task keeps running until it notices power-down has been disabled
+        powerDownTask = true;
+        kernel::Task::Run(*this, &SPIFlash::PowerDownTask);
+    }
+}
+
+//! Decodes an SFDP typical sector erase time to milliseconds
+static unsigned SFDPEraseTime(unsigned t)
+{
+    static const uint16_t units[] = { 1, 16, 128, 1000 };
+    return ((t & 31) + 1) * units[t >> 5];
+}
+
+//! Decodes an SFDP typical chip erase time to milliseconds
+static unsigned SFDPChipEraseTime(unsigned t)
+{
+    static const uint32_t units[] = { 16, 256, 4000, 64000 };
+    return ((t & 31) + 1) * units[t >> 5];
 }
 
 async(SPIFlash::Init)
 async_def(
     int i;
     uint32_t id;
-    uint32_t jedecAddr, jedecSize;
+    uint32_t jedecAddr, jedecSize, baitAddr;
+    bool use4ByteOps;
+    uint8_t op;
+    bus::SPI::Descriptor tx;
+    SFDP4BAIT bait;
     union
     {
         SFDPHeader sfdpHeader;
@@ -88,10 +131,30 @@ async_def(
 )
 {
     init = false;
+    readOp = OP_READ;
+    readDummy = 0;
+    programOp = OP_PROGRAM;
+
+    // the device may have been left in deep power-down, release is harmless otherwise
+    opReleasePowerDown = OP_RELEASE_POWER_DOWN;
+    await(spi.Acquire, cs);
+    await(ReleasePowerDown);
+    spi.Release();
 
-    // first read device ID - this also wakes up the device from powerdown if needed
     f.id = await(ReadID);
 
+    if (addr4Entered)
+    {
+        // SFDP is always read using 3-byte addresses, leave the 4-byte mode entered before
+        await(spi.Acquire, cs);
+        f.op = OP_EXIT_4B;
+        f.tx.Transmit(f.op);
+        await(spi.Transfer, f.tx);
+        spi.Release();
+        addr4Entered = false;
+    }
+    addr4 = false;
+
     await(ReadSFDP, 0, f.sfdpHeader);
     if (f.sfdpHeader.sig != ID("SFDP"))
     {
@@ -101,23 +164,34 @@ async_def(
 
     MYDBG("SFDP header v%d.%d, %d tables", f.sfdpHeader.maj, f.sfdpHeader.min, f.sfdpHeader.cnt + 1);
 
+    f.jedecAddr = ~0u;
     for (f.i = f.sfdpHeader.cnt; f.i >= 0; f.i--)
     {
         await(ReadSFDP, sizeof(SFDPHeader) + f.i * sizeof(SFDPTable), f.sfdpTable);
-        MYDBG("SFDP table %d: ID %02X v%d.%d, %d words @ %X", f.i, f.sfdpTable.id, f.sfdpTable.maj, f.sfdpTable.min, f.sfdpTable.words, f.sfdpTable.addr);
+        MYDBG("SFDP table %d: ID %02X%02X v%d.%d, %d words @ %X", f.i, f.sfdpTable.idMsb, f.sfdpTable.id, f.sfdpTable.maj, f.sfdpTable.min, f.sfdpTable.words, f.sfdpTable.addr);
 
-        if (f.sfdpTable.id == 0)
-            break;
+        if (f.sfdpTable.id == 0 && f.jedecAddr == ~0u)
+        {
+            f.jedecAddr = f.sfdpTable.addr;
+            f.jedecSize = f.sfdpTable.words << 2;
+        }
+        else if (f.sfdpTable.id == SFDP_4BAIT_ID && f.sfdpTable.idMsb == 0xFF && !f.baitAddr)
+        {
+            f.baitAddr = f.sfdpTable.addr;
+        }
     }
 
-    if (f.sfdpTable.id)
+    if (f.jedecAddr == ~0u)
     {
         MYDBG("SFDP JEDEC table not found");
         async_return(false);
     }
 
-    f.jedecAddr = f.sfdpTable.addr;
-    f.jedecSize = f.sfdpTable.words << 2;
+    if (f.baitAddr)
+    {
+        await(ReadSFDP, f.baitAddr, f.bait);
+    }
+
     if (f.jedecSize > sizeof(SFDPJEDEC))
     {
         f.jedecSize = sizeof(SFDPJEDEC);
@@ -128,7 +202,79 @@ async_def(
     }
     await(ReadSFDP, f.jedecAddr, Buffer(&f.sfdp, f.jedecSize));
 
-    size = (f.sfdp.density + 1) / 8;
+    if (GETBIT(f.sfdp.density, 31))
+    {
+        // density is specified as 2^N bits
+        size = 1 << ((f.sfdp.density & 0x7FFFFFFF) - 3);
+    }
+    else
+    {
+        size = (f.sfdp.density + 1) / 8;
+    }
+
+    if (size == 0)
+    {
+        MYDBG("Density missing in SFDP, using RDID");
+        MYDBG("RDID: mfg = %02X, type = %02X, capacity = %02X",
+            uint8_t(f.id), uint8_t(f.id >> 8), uint8_t(f.id >> 16));
+        size = 1 << uint8_t(f.id >> 16);
+    }
+
+    MYDBG("%d MB FLASH detected", size / 1024 / 1024);
+
+    if (size > ADDR3_LIMIT)
+    {
+        if (f.sfdp.addressBytes == Addr3Byte)
+        {
+            MYDBG("4-byte addressing not supported, using only the first %d MB", ADDR3_LIMIT / 1024 / 1024);
+            size = ADDR3_LIMIT;
+        }
+        else if (f.baitAddr && f.bait.read && f.bait.program && f.bait.eraseType)
+        {
+            // dedicated 4-byte address instructions leave the device in the default 3-byte mode,
+            // without any 4-byte erase instruction the device is switched to 4-byte mode instead
+            MYDBG("using 4-byte address instruction set");
+            f.use4ByteOps = true;
+            addr4 = true;
+            programOp = OP_PROGRAM_4B;
+
+            for (unsigned i = 0; i < countof(f.sfdp.sec); i++)
+            {
+                if (GETBIT(f.bait.eraseType, i))
+                {
+                    f.sfdp.sec[i].op = f.bait.opErase[i];
+                }
+                else
+                {
+                    // erase type cannot be used with 4-byte addresses
+                    f.sfdp.sec[i].bits = 0;
+                }
+            }
+        }
+        else if (f.sfdp.addressBytes == Addr4Byte || f.sfdp.enter4ByteAlways)
+        {
+            MYDBG("device is operating in 4-byte address mode");
+            addr4 = true;
+        }
+        else
+        {
+            MYDBG("entering 4-byte address mode");
+            await(spi.Acquire, cs);
+            if (f.sfdp.enter4ByteWrenB7 || !f.sfdp.enter4ByteB7)
+            {
+                // older SFDP revisions do not specify the method, WREN is harmless if not required
+                f.op = OP_WREN;
+                f.tx.Transmit(f.op);
+                await(spi.Transfer, f.tx);
+            }
+            f.op = OP_ENTER_4B;
+            f.tx.Transmit(f.op);
+            await(spi.Transfer, f.tx);
+            spi.Release();
+            addr4 = addr4Entered = true;
+        }
+    }
+
     sectorTypeCount = 0;
 
     for (auto& sec: f.sfdp.sec)
@@ -137,30 +283,74 @@ async_def(
             AddSectorType(sec);
     }
 
-    if (!f.sfdp.noErase4k)
+    if (!f.sfdp.noErase4k && !f.use4ByteOps)
     {
+        // the 4 kB erase opcode takes a 3-byte address, with 4-byte instructions
+        // it is available only if 4BAIT reports it as one of the erase types above
         AddSectorType({ 12, f.sfdp.opErase4k });
     }
 
+    memset(sectorTime, 0, sizeof(sectorTime));
+    chipEraseTime = 0;
+
+    if (f.jedecSize >= 11 * sizeof(uint32_t))
+    {
+        // typical erase times are available (JESD216A and later)
+        unsigned times[] = { f.sfdp.eraseTime1, f.sfdp.eraseTime2, f.sfdp.eraseTime3, f.sfdp.eraseTime4 };
+        for (unsigned j = 0; j < countof(f.sfdp.sec); j++)
+        {
+            for (unsigned i = 0; i < sectorTypeCount; i++)
+            {
+                if (f.sfdp.sec[j].bits && sector[i].bits == f.sfdp.sec[j].bits && sector[i].op == f.sfdp.sec[j].op)
+                {
+                    sectorTime[i] = SFDPEraseTime(times[j]);
+                }
+            }
+        }
+        chipEraseTime = SFDPChipEraseTime(f.sfdp.chipEraseTime);
+    }
+
     for (unsigned i = 0; i < sectorTypeCount; i++)
     {
-        MYDBG("%d KB ERASE OP = %02X", (1 << sector[i].bits) / 1024, sector[i].op);
+        MYDBG("%d KB ERASE OP = %02X, typ %d ms", (1 << sector[i].bits) / 1024, sector[i].op, sectorTime[i]);
     }
 
-    if (size == 0)
+    opSuspend = opResume = 0;
+    suspended = false;
+    if (f.jedecSize >= 13 * sizeof(uint32_t) && !f.sfdp.noSuspend)
     {
-        MYDBG("Density missing in SFDP, using RDID");
-        MYDBG("RDID: mfg = %02X, type = %02X, capacity = %02X",
-            uint8_t(f.id), uint8_t(f.id >> 8), uint8_t(f.id >> 16));
-        size = 1 << uint8_t(f.id >> 16);
+        opSuspend = f.sfdp.opSuspend;
+        opResume = f.sfdp.opResume;
+        resumeInterval = nonzero(mono_t(uint64_t(f.sfdp.eraseResumeInterval + 1) * 64 * MONO_FREQUENCY / 1000000), mono_t(1));
+        MYDBG("ERASE SUSPEND OP = %02X, RESUME OP = %02X, interval %d us", opSuspend, opResume, (f.sfdp.eraseResumeInterval + 1) * 64);
     }
 
-    MYDBG("%d MB FLASH detected", size / 1024 / 1024);
+    opPowerDown = OP_POWER_DOWN;
+    opReleasePowerDown = OP_RELEASE_POWER_DOWN;
+    if (f.jedecSize >= 14 * sizeof(uint32_t))
+    {
+        // deep power-down parameters are available (JESD216B and later)
+        static const uint16_t units[] = { 128, 1000, 8000, 64000 };
+        if (f.sfdp.noPowerDown)
+        {
+            opPowerDown = opReleasePowerDown = 0;
+            powerDownIdle = 0;
+        }
+        else
+        {
+            opPowerDown = f.sfdp.opPowerDown;
+            opReleasePowerDown = f.sfdp.opReleasePowerDown;
+            releaseDelay = mono_t(uint64_t(f.sfdp.releasePowerDownDelay + 1) * units[f.sfdp.releasePowerDownUnit] * MONO_FREQUENCY / 1000000000) + 1;
+            MYDBG("POWER DOWN OP = %02X, RELEASE OP = %02X, %d ns", opPowerDown, opReleasePowerDown, (f.sfdp.releasePowerDownDelay + 1) * units[f.sfdp.releasePowerDownUnit]);
+        }
+    }
+
+    SelectReadMode(f.sfdp, f.use4ByteOps ? &f.bait : NULL);
 
     init = true;
 
     // make sure the device is not completing some previous operation
-    deviceBusy = true;
+    SetBusy();
     await(SyncAndAcquire);
     spi.Release();
 
@@ -192,6 +382,78 @@ void SPIFlash::AddSectorType(SectorType st)
     }
 }
 
+void SPIFlash::SelectReadMode(const SFDPJEDEC& sfdp, const SFDP4BAIT* bait)
+{
+    // report the multi-I/O read modes advertised by the device
+    if (sfdp.fast112sup)
+    {
+        MYDBG("1-1-2 READ OP = %02X, %d+%d cycles", sfdp.fast112.op, sfdp.fast112.mode, sfdp.fast112.ws);
+    }
+    if (sfdp.fast122sup)
+    {
+        MYDBG("1-2-2 READ OP = %02X, %d+%d cycles", sfdp.fast122.op, sfdp.fast122.mode, sfdp.fast122.ws);
+    }
+    if (sfdp.fast114sup)
+    {
+        MYDBG("1-1-4 READ OP = %02X, %d+%d cycles", sfdp.fast114.op, sfdp.fast114.mode, sfdp.fast114.ws);
+    }
+    if (sfdp.fast144sup)
+    {
+        MYDBG("1-4-4 READ OP = %02X, %d+%d cycles", sfdp.fast144.op, sfdp.fast144.mode, sfdp.fast144.ws);
+    }
+    if (sfdp.fast222sup)
+    {
+        MYDBG("2-2-2 READ OP = %02X, %d+%d cycles", sfdp.fast222.op, sfdp.fast222.mode, sfdp.fast222.ws);
+    }
+    if (sfdp.fast444sup)
+    {
+        MYDBG("4-4-4 READ OP = %02X, %d+%d cycles", sfdp.fast444.op, sfdp.fast444.mode, sfdp.fast444.ws);
+    }
+
+    // bus::SPI transfers data over a single line, which makes the 1-1-1
+    // fast read (mandatory for all SFDP devices) the best mode available,
+    // it requires 8 dummy cycles following the address
+    if (!bait)
+    {
+        readOp = OP_FAST_READ;
+        readDummy = 1;
+    }
+    else if (bait->fastRead)
+    {
+        readOp = OP_FAST_READ_4B;
+        readDummy = 1;
+    }
+    else
+    {
+        readOp = OP_READ_4B;
+        readDummy = 0;
+    }
+    MYDBG("using READ OP = %02X, %d dummy bytes", readOp, readDummy);
+}
+
+SPIFlash::Command SPIFlash::MakeCommand(uint8_t op, uint32_t addr, size_t dummy) const
+{
+    Command cmd;
+    cmd.length = 0;
+    cmd.data[cmd.length++] = op;
+    if (addr4)
+    {
+        cmd.data[cmd.length++] = uint8_t(addr >> 24);
+    }
+    cmd.data[cmd.length++] = uint8_t(addr >> 16);
+    cmd.data[cmd.length++] = uint8_t(addr >> 8);
+    cmd.data[cmd.length++] = uint8_t(addr);
+
+    // dummy cycles are sent as all ones, so that any mode bits
+    // never enable continuous read mode
+    ASSERT(cmd.length + dummy <= sizeof(cmd.data));
+    while (dummy--)
+    {
+        cmd.data[cmd.length++] = 0xFF;
+    }
+    return cmd;
+}
+
 async(SPIFlash::ReadSFDP, uint32_t addr, char* buffer, size_t length)
 async_def(
     PACKED_UNALIGNED_STRUCT
@@ -237,80 +499,174 @@ async_def(
     while (f.read < length)
     {
         Cache* c;
-        c = (Cache*)await(EnsureCache, CacheAddress(addr + f.read));
-        size_t block = std::min(length - f.read, CacheRemaining(addr + f.read));
-        memcpy(buffer + f.read, c->data + CacheOffset(addr + f.read), block);
-        f.read += block;
+        c = (Cache*)await(EnsureCache, addr + f.read, length - f.read);
+        auto part = CacheSpan(*c, addr + f.read, length - f.read);
+        memcpy(buffer + f.read, part.Pointer(), part.Length());
+        f.read += part.Length();
+    }
+
+    if (suspended)
+    {
+        await(ResumeErase);
     }
 
+    stats.Count(IOStats::Read, length);
     INCSTAT(reads);
     MYDIAG(DIAG_READ, "%X==%H", addr, Span(buffer, length));
 }
 async_end
 
-async(SPIFlash::EnsureCache, uint32_t addr)
-async_def(
-    Cache* c;
-    PACKED_UNALIGNED_STRUCT
+SPIFlash::Cache* SPIFlash::FindCache(uint32_t addr) const
+{
+    addr = CacheAddress(addr);
+    Cache* set = CacheSet(addr);
+    for (size_t i = 0; i < cacheWays; i++)
     {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
-    bus::SPI::Descriptor tx[2];
-    mono_t t0;
-)
+        if (set[i].address == addr)
+        {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+SPIFlash::Cache* SPIFlash::EvictCache(uint32_t addr)
 {
-    for (size_t i = 0; i < cachePages; i++)
+    Cache* set = CacheSet(addr);
+    Cache* c = &set[0];
+    for (size_t i = 1; i < cacheWays; i++)
     {
-        if (cache[i].address == addr)
+        if (OVF_GT(set[i].gen, cacheGen) || OVF_LT(set[i].gen, c->gen))
         {
-            cache[i].gen = cacheGen++;
-            async_return(intptr_t(&cache[i]));
+            c = &set[i];
         }
     }
 
-    f.t0 = MONO_CLOCKS;
-    await(SyncAndAcquire);
+    c->address = ~0u;
+    c->gen = cacheGen++;
+    return c;
+}
+
+void SPIFlash::UpdateCache(uint32_t addr, size_t length, const char* data, uint8_t value)
+{
+    while (length)
+    {
+        size_t len = std::min(length, CacheRemaining(addr));
+        if (Cache* c = FindCache(addr))
+        {
+            char* dst = c->data + CacheOffset(addr);
+            if (data)
+            {
+                for (size_t i = 0; i < len; i++)
+                {
+                    *dst++ &= data[i];
+                }
+            }
+            else
+            {
+                for (size_t i = 0; i < len; i++)
+                {
+                    *dst++ &= value;
+                }
+            }
+            c->gen = cacheGen++;
+        }
+
+        addr += len;
+        length -= len;
+        if (data)
+        {
+            data += len;
+        }
+    }
+}
 
-    f.c = &cache[0];
-    for (size_t i = 1; i < cachePages; i++)
+void SPIFlash::EraseCache(uint32_t start, uint32_t end)
+{
+    for (size_t i = 0; i < cacheLines; i++)
     {
-        if (OVF_GT(cache[i].gen, cacheGen) || OVF_LT(cache[i].gen, f.c->gen))
+        if (cache[i].address >= start && cache[i].address < end)
         {
-            f.c = &cache[i];
+            Buffer(cache[i].data, CacheLineSize()).Fill(255);
+            cache[i].gen = cacheGen++;
         }
     }
+}
 
-    f.c->address = ~0u;
-    f.req = { OP_READ, TO_BE24(addr) };
-    f.tx[0].Transmit(f.req);
-    f.tx[1].Receive(f.c->data);
-    await(spi.Transfer, f.tx);
+async(SPIFlash::EnsureCache, uint32_t addr, size_t length)
+async_def(
+    uint32_t addr;
+    size_t count;
+    Cache* line[CACHE_BURST];
+    Command req;
+    bus::SPI::Descriptor tx[1 + CACHE_BURST];
+    mono_t t0;
+)
+{
+    Cache* c;
+    if ((c = FindCache(addr)))
+    {
+        stats.cacheHits++;
+        c->gen = cacheGen++;
+        async_return(intptr_t(c));
+    }
+
+    stats.cacheMisses++;
+    f.t0 = MONO_CLOCKS;
+    await(SyncAndAcquire, CacheAddress(addr), CacheAddress(addr) + (std::min(size_t(CACHE_BURST), cacheLines) << cacheLineBits));
+
+    if ((c = FindCache(addr)))
+    {
+        // line was read by another task while waiting for the device
+        spi.Release();
+        c->gen = cacheGen++;
+        async_return(intptr_t(c));
+    }
+
+    // read a run of consecutive lines that are missing from the cache in a single burst,
+    // the lines map to consecutive sets, so the burst cannot evict any of its own lines
+    // as long as it is not longer than the whole cache
+    f.addr = CacheAddress(addr);
+    f.count = 0;
+    do
+    {
+        c = EvictCache(f.addr + (f.count << cacheLineBits));
+        f.line[f.count] = c;
+        f.tx[f.count + 1].Receive(Buffer(c->data, CacheLineSize()));
+    } while (++f.count < std::min(size_t(CACHE_BURST), cacheLines) &&
+        (f.count << cacheLineBits) < CacheOffset(addr) + length &&
+        f.addr + (f.count << cacheLineBits) < size &&
+        !FindCache(f.addr + (f.count << cacheLineBits)));
+
+    f.req = ReadCommand(f.addr);
+    f.tx[0].Transmit(f.req.GetSpan());
+    await(spi.Transfer, f.tx, f.count + 1);
     spi.Release();
     INCSTAT(pageReads);
-    MYDIAG(DIAG_CACHE_READ, "cache %d: %X %d", f.c - cache, addr, MONO_CLOCKS - f.t0);
-    f.c->address = addr;
-    f.c->gen = cacheGen++;
-    async_return(intptr_t(f.c));
+    stats.Latency(IOStats::Read, IOStats::Microseconds(MONO_CLOCKS - f.t0));
+    MYDIAG(DIAG_CACHE_READ, "cache %d+%d: %X %d", f.line[0] - cache, f.count, f.addr, MONO_CLOCKS - f.t0);
+
+    for (size_t i = 0; i < f.count; i++)
+    {
+        f.line[i]->address = f.addr + (i << cacheLineBits);
+        f.line[i]->gen = cacheGen++;
+    }
+    async_return(intptr_t(f.line[0]));
 }
 async_end
 
 async(SPIFlash::ReadToRegister, uint32_t addr, volatile void* reg, size_t length)
 async_def(
-    PACKED_UNALIGNED_STRUCT
-    {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
+    Command req;
     bus::SPI::Descriptor tx[2];
     size_t read;
 )
 {
     while (f.read < length)
     {
-        await(SyncAndAcquire);
-        f.req = { OP_READ, TO_BE24(addr + f.read) };
-        f.tx[0].Transmit(f.req);
+        await(SyncAndAcquire, addr + f.read, addr + f.read + std::min(length - f.read, spi.MaximumTransferSize()));
+        f.req = ReadCommand(addr + f.read);
+        f.tx[0].Transmit(f.req.GetSpan());
         f.tx[1].ReceiveSame(reg, std::min(length - f.read, spi.MaximumTransferSize()));
         await(spi.Transfer, f.tx);
         spi.Release();
@@ -318,6 +674,12 @@ async_def(
         f.read += f.tx[1].Length();
     }
 
+    if (suspended)
+    {
+        await(ResumeErase);
+    }
+
+    stats.Count(IOStats::Read, length);
     INCSTAT(reads);
     MYDIAG(DIAG_READ, "%X=%d=>%p", addr, length, reg);
 }
@@ -325,18 +687,11 @@ async_end
 
 async(SPIFlash::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
 async_def(
-    PACKED_UNALIGNED_STRUCT
-    {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
+    Command req;
     bus::SPI::Descriptor tx[2];
-    size_t read;
+    size_t read, len;
 )
 {
-    f.req.op = OP_READ;
-    f.tx[0].Transmit(f.req);
-
     while (f.read < length)
     {
         if (!pipe.Available() && !await(pipe.Allocate, length - f.read, timeout))
@@ -345,31 +700,43 @@ async_def(
         }
 
         {
-            Buffer buf = pipe.GetBuffer();
+            Buffer buf = pipe.GetBuffer().Left(length - f.read);
 
-            for (size_t i = 0; i < cachePages; i++)
+            if (Cache* c = FindCache(addr + f.read))
             {
-                if (cache[i].address == CacheAddress(addr + f.read))
-                {
-                    auto part = cache[i].GetSpan(addr + f.read, length - f.read);
-                    part.CopyTo(buf);
-                    goto cachedRead;
-                }
+                stats.cacheHits++;
+                auto part = CacheSpan(*c, addr + f.read, buf.Length());
+                part.CopyTo(buf);
+                f.len = part.Length();
             }
+            else
+            {
+                f.req = ReadCommand(addr + f.read);
+                f.tx[0].Transmit(f.req.GetSpan());
+                f.tx[1].Receive(buf.Left(spi.MaximumTransferSize()));
+                f.len = 0;
+            }
+        }
 
-            f.tx[1].Receive(buf.Left(spi.MaximumTransferSize()).Left(length - f.read));
-            f.req.addrBE = TO_BE24(addr + f.read);
+        if (!f.len)
+        {
+            await(SyncAndAcquire, addr + f.read, addr + f.read + f.tx[1].Length());
+            await(spi.Transfer, f.tx);
+            spi.Release();
+            INCSTAT(pageReads);
+            f.len = f.tx[1].Length();
         }
 
-        await(spi.Acquire, cs);
-        await(spi.Transfer, f.tx);
-        spi.Release();
-        INCSTAT(pageReads);
-cachedRead:
-        pipe.Advance(f.tx[1].Length());
-        f.read += f.tx[1].Length();
+        pipe.Advance(f.len);
+        f.read += f.len;
+    }
+
+    if (suspended)
+    {
+        await(ResumeErase);
     }
 
+    stats.Count(IOStats::Read, f.read);
     INCSTAT(reads);
     async_return(f.read);
 }
@@ -377,11 +744,8 @@ async_end
 
 async(SPIFlash::WriteImpl, uint32_t addr, const char* data, size_t length)
 async_def(
-    PACKED_UNALIGNED_STRUCT
-    {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
+    Command req;
+    uint8_t wren;
     size_t written, len;
     bus::SPI::Descriptor tx[2];
 )
@@ -394,71 +758,177 @@ async_def(
         MYDIAG(DIAG_WRITE, "%X=%H", addr + f.written, Span(data + f.written, f.len));
 
         // modify cached page data
-        for (size_t i = 0; i < cachePages; i++)
-        {
-            if (cache[i].address == CacheAddress(addr + f.written))
-            {
-                const char* src = data + f.written;
-                char* dst = cache[i].data + CacheOffset(addr + f.written);
-                for (size_t ii = 0; ii < f.len; ii++)
-                {
-                    *dst++ &= *src++;
-                }
-                cache[i].gen = cacheGen++;
-            }
-        }
+        UpdateCache(addr + f.written, f.len, data + f.written);
 
-        f.req.op = OP_WREN;
-        f.tx[0].Transmit(f.req.op);
+        f.wren = OP_WREN;
+        f.tx[0].Transmit(f.wren);
         await(spi.Transfer, f.tx[0]);
 
-        f.req = { OP_PROGRAM, TO_BE24(addr + f.written) };
-        f.tx[0].Transmit(f.req);
+        f.req = MakeCommand(programOp, addr + f.written);
+        f.tx[0].Transmit(f.req.GetSpan());
         f.tx[1].Transmit(Span(data + f.written, f.len));
         await(spi.Transfer, f.tx);
 
-        deviceBusy = true;
+        SetBusy();
         spi.Release();
         INCSTAT(pageWrites);
 
         f.written += f.len;
     }
 
+    stats.Count(IOStats::Write, length);
     INCSTAT(writes);
 }
 async_end
 
-async(SPIFlash::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async(SPIFlash::ReadV, const ByteStorage::ReadSegment* segments, size_t count, uint32_t offset)
 async_def(
-    size_t written;
-    Span span;
+    Command req;
+    bus::SPI::Descriptor tx[1 + VECTOR_MAX];
+    size_t i, n;
+    uint32_t start, end;
 )
 {
-    while (f.written < length)
+    while (f.i < count)
     {
-        if (!pipe.Available() && !await(pipe.Require, 1, timeout))
+        // collect a run of adjacent segments
+        f.start = f.end = offset + segments[f.i].addr;
+        for (f.n = 0; f.i + f.n < count && f.n < VECTOR_MAX; f.n++)
         {
-            break;
+            auto& seg = segments[f.i + f.n];
+            if (offset + seg.addr != f.end || seg.data.Length() > spi.MaximumTransferSize())
+            {
+                break;
+            }
+            f.tx[1 + f.n].Receive(seg.data);
+            f.end += seg.data.Length();
         }
 
-        f.span = pipe.GetSpan().Left(length - f.written);
-        await(Write, addr + f.written, f.span);
-        pipe.Advance(f.span.Length());
-        f.written += f.span.Length();
+        if (f.n < 2)
+        {
+            // nothing to merge, use the regular (cached) path
+            await(ReadImpl, f.start, (char*)segments[f.i].data.Pointer(), segments[f.i].data.Length());
+            f.i++;
+            continue;
+        }
+
+        f.req = ReadCommand(f.start);
+        f.tx[0].Transmit(f.req.GetSpan());
+        await(SyncAndAcquire, f.start, f.end);
+        await(spi.Transfer, f.tx, f.n + 1);
+        spi.Release();
+        INCSTAT(pageReads);
+        stats.Count(IOStats::Read, f.end - f.start);
+        MYDIAG(DIAG_READ, "%X==%d segments", f.start, f.n);
+        f.i += f.n;
     }
 
-    async_return(f.written);
+    if (suspended)
+    {
+        await(ResumeErase);
+    }
+
+    INCSTAT(reads);
 }
 async_end
 
-async(SPIFlash::Fill, uint32_t addr, uint8_t value, size_t length)
+async(SPIFlash::WriteV, const ByteStorage::WriteSegment* segments, size_t count, uint32_t offset)
 async_def(
-    uint8_t value;
-    PACKED_UNALIGNED_STRUCT
+    Command req;
+    uint8_t wren;
+    bus::SPI::Descriptor tx[2];
+    size_t i, n, k;
+    uint32_t start, end;
+)
+{
+    while (f.i < count)
     {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
+        // collect a run of ascending segments within a single page
+        f.start = f.end = offset + segments[f.i].addr;
+        for (f.n = 0; f.i + f.n < count; f.n++)
+        {
+            auto& seg = segments[f.i + f.n];
+            uint32_t addr = offset + seg.addr;
+            if (addr < f.end || !IsSamePage(f.start, addr + seg.data.Length() - 1))
+            {
+                break;
+            }
+            f.end = addr + seg.data.Length();
+        }
+
+        if (f.n < 2)
+        {
+            // nothing to merge, use the regular path
+            await(WriteImpl, f.start, (const char*)segments[f.i].data.Pointer(), segments[f.i].data.Length());
+            f.i++;
+            continue;
+        }
+
+        await(SyncAndAcquire);
+
+        // the run is assembled in the scratch buffer, programming the gaps
+        // between the segments with 0xFF leaves their contents unchanged
+        memset(scratch, 0xFF, f.end - f.start);
+        for (f.k = 0; f.k < f.n; f.k++)
+        {
+            auto& seg = segments[f.i + f.k];
+            MYDIAG(DIAG_WRITE, "%X=%H", offset + seg.addr, seg.data);
+            memcpy((char*)scratch + (offset + seg.addr - f.start), seg.data.Pointer(), seg.data.Length());
+            UpdateCache(offset + seg.addr, seg.data.Length(), (const char*)seg.data.Pointer());
+        }
+
+        f.wren = OP_WREN;
+        f.tx[0].Transmit(f.wren);
+        await(spi.Transfer, f.tx[0]);
+
+        f.req = MakeCommand(programOp, f.start);
+        f.tx[0].Transmit(f.req.GetSpan());
+        f.tx[1].Transmit(Span(scratch, f.end - f.start));
+        await(spi.Transfer, f.tx);
+
+        SetBusy();
+        spi.Release();
+        INCSTAT(pageWrites);
+        stats.Count(IOStats::Write, f.end - f.start);
+
+        f.i += f.n;
+    }
+
+    INCSTAT(writes);
+}
+async_end
+
+async(SPIFlash::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    size_t written, len;
+    Span span;
+)
+{
+    while (f.written < length)
+    {
+        // wait for enough data to program the rest of the page at once,
+        // but don't hold back what is available when the wait times out
+        f.len = std::min(PageRemaining(addr + f.written), length - f.written);
+        if (pipe.Available() < f.len && !await(pipe.Require, f.len, timeout) && !pipe.Available())
+        {
+            break;
+        }
+
+        f.span = pipe.GetSpan().Left(f.len);
+        await(Write, addr + f.written, f.span);
+        pipe.Advance(f.span.Length());
+        f.written += f.span.Length();
+    }
+
+    async_return(f.written);
+}
+async_end
+
+async(SPIFlash::Fill, uint32_t addr, uint8_t value, size_t length)
+async_def(
+    uint8_t value;
+    Command req;
+    uint8_t wren;
     size_t written, len;
     bus::SPI::Descriptor tx[2];
 )
@@ -472,64 +942,110 @@ async_def(
         MYDIAG(DIAG_WRITE, "%X=%d*%02X", addr + f.written, f.len, f.value);
 
         // modify cached page data
-        for (size_t i = 0; i < cachePages; i++)
-        {
-            if (cache[i].address == CacheAddress(addr + f.written))
-            {
-                char* dst = cache[i].data + CacheOffset(addr + f.written);
-                for (size_t ii = 0; ii < f.len; ii++)
-                {
-                    *dst++ &= value;
-                }
-                cache[i].gen = cacheGen++;
-            }
-        }
+        UpdateCache(addr + f.written, f.len, NULL, f.value);
 
-        f.req.op = OP_WREN;
-        f.tx[0].Transmit(f.req.op);
+        f.wren = OP_WREN;
+        f.tx[0].Transmit(f.wren);
         await(spi.Transfer, f.tx[0]);
 
-        f.req = { OP_PROGRAM, TO_BE24(addr + f.written) };
-        f.tx[0].Transmit(f.req);
+        f.req = MakeCommand(programOp, addr + f.written);
+        f.tx[0].Transmit(f.req.GetSpan());
         f.tx[1].TransmitSame(&f.value, f.len);
         await(spi.Transfer, f.tx);
 
-        deviceBusy = true;
+        SetBusy();
         spi.Release();
         INCSTAT(pageWrites);
 
         f.written += f.len;
     }
+
+    stats.Count(IOStats::Write, length);
 }
 async_end
 
+//! Checks if the word-aligned data are all filled with the specified value
+static bool IsAllValue(const uint32_t* data, size_t length, uint8_t value)
+{
+    uint32_t pattern = value * 0x01010101u;
+    for (; length >= sizeof(uint32_t); length -= sizeof(uint32_t))
+    {
+        if (*data++ != pattern)
+        {
+            return false;
+        }
+    }
+
+    auto pb = (const uint8_t*)data;
+    while (length--)
+    {
+        if (*pb++ != value)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 async(SPIFlash::IsAll, uint32_t addr, uint8_t value, size_t length)
 async_def(
-    size_t checked;
+    size_t checked, len;
+    Command req;
+    bus::SPI::Descriptor tx[2];
 )
 {
+    if (CacheRemaining(addr) >= length)
+    {
+        // short checks can be served from a single cache line, if available
+        if (Cache* c = FindCache(addr))
+        {
+            stats.cacheHits++;
+            stats.Count(IOStats::Check, length);
+            async_return(CacheSpan(*c, addr, length).IsAll(value));
+        }
+    }
+
+    // longer ranges are streamed through the scratch buffer in large bursts,
+    // bypassing the cache so that it doesn't get polluted
     while (f.checked < length)
     {
-        Cache* c;
-        c = (Cache*)await(EnsureCache, addr + f.checked);
+        f.len = std::min(std::min(length - f.checked, size_t(SCRATCH_SIZE)), spi.MaximumTransferSize());
+        await(SyncAndAcquire, addr + f.checked, addr + f.checked + f.len);
 
-        auto part = c->GetSpan(addr + f.checked, length - f.checked);
-        if (!part.IsAll(value))
+        f.req = ReadCommand(addr + f.checked);
+        f.tx[0].Transmit(f.req.GetSpan());
+        f.tx[1].Receive(Buffer(scratch, f.len));
+        await(spi.Transfer, f.tx);
+        INCSTAT(pageReads);
+
+        // compare while the bus is still acquired, nobody else can use the scratch buffer
+        if (!IsAllValue(scratch, f.len, value))
         {
-            MYDIAG(DIAG_READ, "%X!=%X: %H", addr + f.checked, value, part);
-            async_return(false);
+            MYDIAG(DIAG_READ, "%X!=%X: %H", addr + f.checked, value, Span(scratch, f.len));
+            spi.Release();
+            break;
         }
-        f.checked += part.Length();
+
+        spi.Release();
+        f.checked += f.len;
     }
 
+    if (suspended)
+    {
+        await(ResumeErase);
+    }
+
+    stats.Count(IOStats::Check, f.checked);
     INCSTAT(emptyChecks);
-    async_return(true);
+    async_return(f.checked == length);
 }
 async_end
 
 async(SPIFlash::Erase, uint32_t addr, uint32_t len)
 async_def(
-    uint32_t start, end;
+    uint32_t start, end, blockEnd, sub;
+    uint64_t dirty;
+    int type;
 )
 {
     uint32_t mask;
@@ -546,14 +1062,53 @@ async_def(
 
     while (f.start < f.end)
     {
-        uint32_t next;
-        next = await(EraseFirst, f.start, f.end - f.start);
-        if (next == f.start)
+        f.type = LargestErase(f.start, f.end);
+        if (f.type < 0)
         {
-            // failed to erase anything
+            MYDBG("invalid erase range %X-%X", f.start, f.end);
             async_return(false);
         }
-        f.start = next;
+
+        f.blockEnd = f.start + SectorSize(f.type);
+        f.dirty = 0;
+
+        if ((SectorSize(f.type) >> SectorSizeBits()) <= 64)
+        {
+            // blank checks are much faster than erases, find the smallest sectors that really need erasing
+            for (f.sub = f.start; f.sub < f.blockEnd; f.sub += SectorSize())
+            {
+                if (!await(IsEmpty, f.sub, SectorSize()))
+                {
+                    f.dirty |= uint64_t(1) << ((f.sub - f.start) >> SectorSizeBits());
+                }
+            }
+
+            if (!f.dirty)
+            {
+                MYDIAG(DIAG_WRITE, "%X...%X blank", f.start, f.blockEnd);
+                f.start = f.blockEnd;
+                continue;
+            }
+
+            f.type = PlanErase(f.type, f.dirty);
+        }
+
+        // erase the sectors of the selected type containing dirty sectors (all if not checked)
+        for (f.sub = f.start; f.sub < f.blockEnd; f.sub += SectorSize(f.type))
+        {
+            if (f.dirty && !(f.dirty & SubsectorMask(f.sub - f.start, f.type)))
+            {
+                continue;
+            }
+
+            if (await(EraseSector, f.sub, f.type) == f.sub)
+            {
+                // failed to erase anything
+                async_return(false);
+            }
+        }
+
+        f.start = f.blockEnd;
     }
 
     INCSTAT(erases);
@@ -561,17 +1116,57 @@ async_def(
 }
 async_end
 
-async(SPIFlash::EraseFirst, uint32_t addr, uint32_t len)
-async_def(
-    PACKED_UNALIGNED_STRUCT
+int SPIFlash::LargestErase(uint32_t start, uint32_t end) const
+{
+    for (int i = sectorTypeCount - 1; i >= 0; i--)
     {
-        uint8_t op;
-        uint32_t addrBE : 24;
-    } req;
-    uint8_t wren;
-    uint32_t start, end;
-    bus::SPI::Descriptor tx;
-)
+        if ((start & SectorMask(i)) == 0 && (start + SectorSize(i)) <= end)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int SPIFlash::PlanErase(int type, uint64_t dirty) const
+{
+    int best = type;
+    uint32_t bestTime = sectorTime[type];
+
+    if (!bestTime)
+    {
+        // without typical times, just erase the whole block
+        return type;
+    }
+
+    for (int i = 0; i < type; i++)
+    {
+        if (!sectorTime[i])
+        {
+            continue;
+        }
+
+        uint32_t time = 0;
+        for (uint32_t offset = 0; offset < SectorSize(type); offset += SectorSize(i))
+        {
+            if (dirty & SubsectorMask(offset, i))
+            {
+                time += sectorTime[i];
+            }
+        }
+
+        if (time < bestTime)
+        {
+            best = i;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+async(SPIFlash::EraseFirst, uint32_t addr, uint32_t len)
+async_def()
 {
     uint32_t start, end, mask;
 
@@ -582,44 +1177,50 @@ async_def(
 
     // find the largest eraseable size
     int i;
-    for (i = sectorTypeCount - 1; i >= 0; i--)
+    i = LargestErase(start, end);
+    if (i < 0)
     {
-        if ((start & SectorMask(i)) == 0 && (start + SectorSize(i)) <= end)
-        {
-            f.req = { sector[i].op, TO_BE24(start) };
-            f.start = start;
-            f.end = start + SectorSize(i);
+        MYDBG("invalid erase range %X-%X", start, end);
+        async_return(addr);
+    }
 
-            await(SyncAndAcquire);
-            MYDBG("erasing %d KB block starting at %X", (f.end - f.start) / 1024, f.start);
-            MYDIAG(DIAG_WRITE, "%X...", f.start);
+    async_return(await(EraseSector, start, i));
+}
+async_end
 
-            for (size_t i = 0 ; i < cachePages; i++)
-            {
-                if (cache[i].address >= f.start && cache[i].address < f.end)
-                {
-                    Buffer(cache[i].data).Fill(255);
-                    cache[i].gen = cacheGen++;
-                }
-            }
+async(SPIFlash::EraseSector, uint32_t addr, int type)
+async_def(
+    Command req;
+    uint8_t wren;
+    uint32_t start, end;
+    bus::SPI::Descriptor tx;
+)
+{
+    f.req = MakeCommand(sector[type].op, addr);
+    f.start = addr;
+    f.end = addr + SectorSize(type);
 
-            f.wren = OP_WREN;
-            f.tx.Transmit(f.wren);
-            await(spi.Transfer, f.tx);
+    await(SyncAndAcquire);
+    MYDBG("erasing %d KB block starting at %X", (f.end - f.start) / 1024, f.start);
+    MYDIAG(DIAG_WRITE, "%X...", f.start);
 
-            f.tx.Transmit(f.req);
-            await(spi.Transfer, f.tx);
+    EraseCache(f.start, f.end);
 
-            deviceBusy = true;
-            spi.Release();
-            INCSTAT(sectorErases);
+    f.wren = OP_WREN;
+    f.tx.Transmit(f.wren);
+    await(spi.Transfer, f.tx);
 
-            async_return(f.end);
-        }
-    }
+    f.tx.Transmit(f.req.GetSpan());
+    await(spi.Transfer, f.tx);
 
-    MYDBG("invalid erase range %X-%X", start, end);
-    async_return(addr);
+    SetBusy(true, sectorTime[type]);
+    eraseStart = f.start;
+    eraseEnd = f.end;
+    spi.Release();
+    INCSTAT(sectorErases);
+    stats.Count(IOStats::Erase, f.end - f.start);
+
+    async_return(f.end);
 }
 async_end
 
@@ -633,11 +1234,7 @@ async_def(
 
     await(SyncAndAcquire);
 
-    for (size_t i = 0 ; i < cachePages; i++)
-    {
-        Buffer(cache[i].data).Fill(255);
-        cache[i].gen = cacheGen++;
-    }
+    EraseCache(0, ~0u);
 
     f.op = OP_WREN;
     f.tx.Transmit(f.op);
@@ -645,7 +1242,10 @@ async_def(
     f.op = OP_CHIP_ERASE;
     await(spi.Transfer, f.tx);
 
-    deviceBusy = true;
+    SetBusy(true, chipEraseTime);
+    stats.Count(IOStats::Erase, Size());
+    eraseStart = 0;
+    eraseEnd = ~0u;
     await(SyncAndAcquire);
     spi.Release();
 
@@ -653,28 +1253,118 @@ async_def(
 }
 async_end
 
-async(SPIFlash::SyncAndAcquire)
+void SPIFlash::SetBusy(bool erase, uint32_t typical)
+{
+    deviceBusy = true;
+    busyErase = erase;
+    busyTypical = typical;
+    busyStart = resumeTime = MONO_CLOCKS;
+}
+
+uint32_t SPIFlash::EraseWait(uint32_t& backoff) const
+{
+    uint32_t elapsed = (MONO_CLOCKS - busyStart) / (MONO_FREQUENCY / 1000);
+    if (elapsed < busyTypical)
+    {
+        // the erase is not expected to complete sooner
+        return busyTypical - elapsed;
+    }
+
+    // back off exponentially, checking at least every 1/8 of the typical time
+    backoff = std::min(backoff ? backoff * 2 : 1, std::max(busyTypical / 8, uint32_t(2)));
+    return backoff;
+}
+
+async(SPIFlash::SyncAndAcquire, uint32_t readStart, uint32_t readEnd, bool access)
 async_def(
     unsigned attempt;
-    uint8_t op;
+    uint32_t backoff, delay;
+    uint8_t op, cmd;
     uint8_t status;
-    bus::SPI::Descriptor tx[2];
+    bus::SPI::Descriptor tx[2], txCmd;
 )
 {
     await(spi.Acquire, cs);
 
-    if (!deviceBusy)
-    {
-        async_return(true);
-    }
-
     f.op = OP_STATUS;
     f.tx[0].Transmit(f.op);
     f.tx[1].Receive(f.status);
+    f.txCmd.Transmit(f.cmd);
 
     for (f.attempt = 0; ; f.attempt++)
     {
-        await(spi.Transfer, f.tx);
+        if (poweredDown)
+        {
+            if (!access)
+            {
+                // nothing is in progress in power-down
+                async_return(true);
+            }
+            await(ReleasePowerDown);
+        }
+
+        if (access)
+        {
+            lastAccess = MONO_CLOCKS;
+        }
+
+        bool read;
+        bool readErased;
+        read = readEnd > readStart;
+        readErased = readStart < eraseEnd && readEnd > eraseStart;
+
+        if (suspended && (!read || readErased))
+        {
+            // the operation cannot be performed while the erase is suspended
+            f.cmd = opResume;
+            await(spi.Transfer, f.txCmd);
+            suspended = false;
+            deviceBusy = true;
+            resumeTime = MONO_CLOCKS;
+            MYDIAG(DIAG_WAIT, "resume");
+            continue;
+        }
+
+        if (!deviceBusy)
+        {
+            async_return(true);
+        }
+
+        if (read && !readErased && busyErase && opSuspend)
+        {
+            if (MONO_CLOCKS - resumeTime < resumeInterval)
+            {
+                // the erase must be allowed to progress before being suspended again
+                spi.Release();
+                async_yield();
+                await(spi.Acquire, cs);
+                continue;
+            }
+
+            f.cmd = opSuspend;
+            await(spi.Transfer, f.txCmd);
+            MYDIAG(DIAG_WAIT, "suspend");
+
+            // suspend latency is in the order of tens of microseconds, keep the bus until
+            // the device is ready, so that nobody else mistakes the suspend for completion
+            do
+            {
+                await(spi.Transfer, f.tx);
+            } while (GETBIT(f.status, 0));
+
+            suspended = true;
+            deviceBusy = false;
+            async_return(true);
+        }
+
+        if (useReadyPin)
+        {
+            f.status = readyPin.Get() != readyPinLevel;
+        }
+        else
+        {
+            await(spi.Transfer, f.tx);
+        }
 
         if (!GETBIT(f.status, 0))
         {
@@ -682,27 +1372,148 @@ async_def(
             {
                 MYDIAG(DIAG_WAIT, "...%d", f.attempt);
             }
+            lastWait = { f.attempt + 1, MONO_CLOCKS - busyStart };
+            stats.busyPolls += lastWait.polls;
+            {
+                uint32_t us = IOStats::Microseconds(lastWait.time);
+                stats.busyTime += us;
+                stats.Latency(busyErase ? IOStats::Erase : IOStats::Write, us);
+            }
             deviceBusy = false;
-            break;
+            async_return(true);
         }
-        else
+
+        // let other tasks do their work
+        spi.Release();
+        INCSTAT(waits);
+
+        if (!busyErase)
         {
-            // let other tasks do their work
-            spi.Release();
-            INCSTAT(waits);
+            // page programming takes less than a millisecond
             async_yield();
-            await(spi.Acquire, cs);
         }
+        else
+        {
+            // erases take (hundreds of) milliseconds, don't keep the bus and CPU busy
+            f.delay = EraseWait(f.backoff);
+            async_delay_ms(f.delay);
+        }
+
+        await(spi.Acquire, cs);
     }
 }
 async_end
 
+async(SPIFlash::ResumeErase)
+async_def(
+    uint8_t cmd;
+    bus::SPI::Descriptor tx;
+)
+{
+    await(spi.Acquire, cs);
+    if (suspended)
+    {
+        f.cmd = opResume;
+        f.tx.Transmit(f.cmd);
+        await(spi.Transfer, f.tx);
+        suspended = false;
+        deviceBusy = true;
+        resumeTime = MONO_CLOCKS;
+        MYDIAG(DIAG_WAIT, "resume");
+    }
+    spi.Release();
+}
+async_end
+
 async(SPIFlash::Sync)
 async_def()
 {
-    await(SyncAndAcquire);
+    // there is nothing to wait for in power-down, don't wake the device
+    await(SyncAndAcquire, 0, 0, false);
     spi.Release();
 }
 async_end
 
+async(SPIFlash::ReleasePowerDown)
+async_def(
+    bus::SPI::Descriptor tx;
+    mono_t t0;
+)
+{
+    if (releasing)
+    {
+        // another task has already sent the release, wait for it to complete
+        spi.Release();
+        while (poweredDown)
+        {
+            async_yield();
+        }
+        await(spi.Acquire, cs);
+        async_return(0);
+    }
+
+    if (opReleasePowerDown)
+    {
+        f.tx.Transmit(opReleasePowerDown);
+        await(spi.Transfer, f.tx);
+        f.t0 = MONO_CLOCKS;
+
+        if (releaseDelay > mono_t(uint64_t(RELEASE_SPIN_US) * MONO_FREQUENCY / 1000000))
+        {
+            // slow release, don't keep the bus and CPU busy while waiting
+            releasing = true;
+            spi.Release();
+            while (MONO_CLOCKS - f.t0 < releaseDelay)
+            {
+                async_yield();
+            }
+            await(spi.Acquire, cs);
+            releasing = false;
+        }
+        else
+        {
+            // the release takes just a few microseconds, not worth yielding
+            while (MONO_CLOCKS - f.t0 < releaseDelay);
+        }
+        MYDIAG(DIAG_WAIT, "release power down");
+    }
+    poweredDown = false;
+}
+async_end
+
+async(SPIFlash::PowerDownTask)
+async_def(
+    mono_t idle;
+    unsigned delay;
+    bus::SPI::Descriptor tx;
+)
+{
+    while (powerDownIdle)
+    {
+        f.idle = (MONO_CLOCKS - lastAccess) / (MONO_FREQUENCY / 1000);
+        if (poweredDown || suspended || f.idle < powerDownIdle)
+        {
+            // check again when the idle period would expire
+            f.delay = poweredDown ? powerDownIdle : powerDownIdle - std::min(mono_t(powerDownIdle), f.idle);
+            async_delay_ms(nonzero(f.delay, 1u));
+            continue;
+        }
+
+        // wait for a program or erase still in progress
+        await(SyncAndAcquire, 0, 0, false);
+        if (!poweredDown && !deviceBusy && !suspended && powerDownIdle &&
+            (MONO_CLOCKS - lastAccess) / (MONO_FREQUENCY / 1000) >= powerDownIdle)
+        {
+            f.tx.Transmit(opPowerDown);
+            await(spi.Transfer, f.tx);
+            poweredDown = true;
+            MYDIAG(DIAG_WAIT, "power down");
+        }
+        spi.Release();
+    }
+
+    powerDownTask = false;
+}
+async_end
+
 }
@@ -16,13 +16,21 @@
 #include <io/PipeWriter.h>
 #include <io/PipeReader.h>
 
+#include <storage/ByteStorage.h>
+
 namespace storage
 {
 
 class SPIFlash
 {
 public:
-    SPIFlash(bus::SPI spi, GPIOPin cs, size_t cacheSize = 4);
+    //! Creates the SPI flash memory driver
+    /*!
+     * The read cache consists of @p cacheLines lines of 2^@p cacheLineBits bytes,
+     * organized in sets of @p cacheWays lines (the cache is fully associative if
+     * @p cacheWays is zero). The number of sets must be a power of two.
+     */
+    SPIFlash(bus::SPI spi, GPIOPin cs, size_t cacheLines = 4, unsigned cacheLineBits = 5, size_t cacheWays = 0);
     ~SPIFlash();
 
     //! Initialize the SPI flash memory, reading JEDEC data, etc.
@@ -37,6 +45,17 @@ public:
     async(Write, uint32_t addr, Span data) { return async_forward(WriteImpl, addr, data.Pointer(), data.Length()); }
     //! Writes data to the SPI flash memory directly from the specified I/O pipe
     async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout = Timeout::Infinite);
+    //! Reads multiple segments of the SPI flash memory, with @p offset added to all segment addresses
+    /*!
+     * Runs of adjacent segments are read using a single read command.
+     */
+    async(ReadV, const ByteStorage::ReadSegment* segments, size_t count, uint32_t offset = 0);
+    //! Writes multiple segments of data to the SPI flash memory, with @p offset added to all segment addresses
+    /*!
+     * Runs of ascending segments within the same page are programmed using a single program command,
+     * the gaps between them are programmed with 0xFF, leaving their contents unchanged.
+     */
+    async(WriteV, const ByteStorage::WriteSegment* segments, size_t count, uint32_t offset = 0);
     //! Fills a range of the SPI flash memory
     async(Fill, uint32_t addr, uint8_t value, size_t length);
     //! Checks if a range of the SPI flash memory is empty
@@ -46,6 +65,10 @@ public:
     //! Flushes any unwritten data to the SPI flash memory (noop, just for interface compatibility with BufferedSPIFlash)
     async(Flush) async_def_return(true);
     //! Erases at least the specified range of the SPI flash memory, depending on smallest sector size
+    /*!
+     * Sectors that are already blank are skipped, and each block is erased using
+     * the combination of sector sizes with the lowest typical erase time
+     */
     async(Erase, uint32_t addr, uint32_t length);
     //! Erases the first block of the specified range of the SPI flash memory, depending on smallest block size
     //! Returns the address of the next block to be erased
@@ -54,6 +77,33 @@ public:
     async(MassErase);
     //! Makes sure all SPI flash write operations have completed
     async(Sync);
+    //! Uses a ready/busy signal instead of polling the status register while the device is busy
+    void SetReadyPin(GPIOPin pin, bool readyLevel = true) { readyPin = pin; readyPinLevel = readyLevel; useReadyPin = true; }
+    //! Puts the device into deep power-down after a period of inactivity
+    /*!
+     * A background task puts the device into deep power-down once no operation
+     * has accessed it for @p idleMs, the next operation releases it transparently,
+     * waiting just the release time specified by SFDP. Reads served from the cache
+     * do not wake the device, the cache contents are kept during power-down.
+     * Passing zero stops the task, the device wakes up on its next access.
+     */
+    void EnablePowerDown(unsigned idleMs);
+    //! Checks if the device is currently in deep power-down
+    bool IsPoweredDown() const { return poweredDown; }
+
+    //! Busy wait statistics of a single program or erase operation
+    struct WaitStats
+    {
+        uint32_t polls;     //!< number of times the device was checked for completion
+        mono_t time;        //!< time from issuing the operation until the device was found ready
+    };
+
+    //! Gets the busy wait statistics of the last completed program or erase operation
+    const WaitStats& LastWait() const { return lastWait; }
+    //! Gets the I/O statistics of the device, shared by all partitions (latencies are in microseconds)
+    const IOStats& Stats() const { return stats; }
+    //! Resets the I/O statistics of the device
+    void ResetStats() { stats.Reset(); }
 
     //! Size of the SPI flash memory in bytes
     uint32_t Size() const { return size; }
@@ -85,20 +135,38 @@ private:
 
         OP_WREN = 0x06,
         OP_PROGRAM = 0x02,
+        OP_PROGRAM_4B = 0x12,
 
         OP_READ = 0x03,
+        OP_READ_4B = 0x13,
+        OP_FAST_READ = 0x0B,
+        OP_FAST_READ_4B = 0x0C,
         OP_READ_SFDP = 0x5A,
 
+        OP_ENTER_4B = 0xB7,
+        OP_EXIT_4B = 0xE9,
+
         OP_CHIP_ERASE = 0x60,
 
         OP_RDID = 0x9F,
 
+        OP_POWER_DOWN = 0xB9,
+        OP_RELEASE_POWER_DOWN = 0xAB,
+
         PAGE_BITS = 8,
         PAGE_SIZE = 1 << PAGE_BITS,
         PAGE_MASK = PAGE_SIZE - 1,
 
-        CACHE_LINE = 32,
-        CACHE_MASK = CACHE_LINE - 1
+        CACHE_BURST = 8,
+
+        SCRATCH_SIZE = PAGE_SIZE,
+
+        VECTOR_MAX = 8,         //< maximum segments read with a single command, covers a full SPIFlashQueue burst
+
+        ADDR3_LIMIT = 1 << 24,
+        SFDP_4BAIT_ID = 0x84,
+
+        RELEASE_SPIN_US = 5,    //< longest release from deep power-down waited for with the bus held
     };
 
     struct SFDPHeader
@@ -112,7 +180,7 @@ private:
     {
         uint8_t id, min, maj, words;
         uint32_t addr : 24;
-        uint32_t : 8;
+        uint32_t idMsb : 8;
     };
 
     enum JEDECAddressBytes
@@ -187,45 +255,208 @@ private:
 
         // uint8_t 28-35
         SectorType sec[4];
+
+        // uint8_t 36-39 - typical erase times
+        uint32_t eraseTimeMultiplier : 4;
+        uint32_t eraseTime1 : 7;
+        uint32_t eraseTime2 : 7;
+        uint32_t eraseTime3 : 7;
+        uint32_t eraseTime4 : 7;
+
+        // uint8_t 40-43 - page size and typical program times
+        uint32_t programTimeMultiplier : 4;
+        uint32_t pageSizeBits : 4;
+        uint32_t programTime : 6;
+        uint32_t byteTime : 5;
+        uint32_t byteTimeAdditional : 5;
+        uint32_t chipEraseTime : 7;
+        uint32_t : 1;
+
+        // uint8_t 44-47 - suspend/resume capabilities
+        uint32_t suspendProhibited : 8;
+        uint32_t : 1;
+        uint32_t programResumeInterval : 4;
+        uint32_t programSuspendLatency : 7;
+        uint32_t eraseResumeInterval : 4;
+        uint32_t eraseSuspendLatency : 7;
+        uint32_t noSuspend : 1;
+
+        // uint8_t 48-51 - suspend/resume opcodes
+        uint8_t opProgramResume, opProgramSuspend, opResume, opSuspend;
+
+        // uint8_t 52-55 - deep powerdown
+        uint32_t : 8;
+        uint32_t releasePowerDownDelay : 5;
+        uint32_t releasePowerDownUnit : 2;
+        uint32_t opReleasePowerDown : 8;
+        uint32_t opPowerDown : 8;
+        uint32_t noPowerDown : 1;
+
+        // uint8_t 56-59
+        uint32_t : 32;
+
+        // uint8_t 60-63 - 4-byte addressing
+        uint32_t : 24;
+        uint32_t enter4ByteB7 : 1;
+        uint32_t enter4ByteWrenB7 : 1;
+        uint32_t : 3;
+        uint32_t enter4ByteOpcodes : 1;
+        uint32_t enter4ByteAlways : 1;
+        uint32_t : 1;
+    };
+
+    struct SFDP4BAIT
+    {
+        // uint8_t 0-3 - supported 4-byte address instructions
+        uint32_t read : 1;
+        uint32_t fastRead : 1;
+        uint32_t fast112 : 1;
+        uint32_t fast122 : 1;
+        uint32_t fast114 : 1;
+        uint32_t fast144 : 1;
+        uint32_t program : 1;
+        uint32_t program114 : 1;
+        uint32_t program144 : 1;
+        uint32_t eraseType : 4;
+        uint32_t : 19;
+
+        // uint8_t 4-7 - 4-byte address erase opcodes for each erase type
+        uint8_t opErase[4];
+    };
+
+    //! SPI command header - opcode, address and dummy bytes
+    struct Command
+    {
+        uint8_t data[7];
+        uint8_t length;
+
+        Span GetSpan() const { return Span(data, length); }
     };
 
     bus::SPI spi;
     bus::SPI::ChipSelect cs;
     bool init = false;
     bool deviceBusy = false;
+    bool addr4 = false, addr4Entered = false;
 
     uint32_t size;
     SectorType sector[4];
     uint32_t sectorTypeCount = 0;
+    //! Typical erase time in ms for each sector type, 0 if unknown
+    uint16_t sectorTime[4];
+    uint32_t chipEraseTime = 0;
+    uint8_t readOp = OP_READ, readDummy = 0;
+    uint8_t programOp = OP_PROGRAM;
 
     struct Cache
     {
         uint32_t address = ~0u;
         int gen = 0;
-        char data[CACHE_LINE];
-
-        Span GetSpan(uint32_t addr, size_t length) { return Span::Of(data).RemoveLeft(CacheOffset(addr)).Left(length); }
+        char* data;
     };
 
-    size_t cachePages;
+    size_t cacheLines, cacheWays;
+    uint32_t cacheSetMask;
+    uint8_t cacheLineBits;
     int cacheGen = 0;
     Cache* cache;
-
-    static constexpr uint32_t CacheAddress(uint32_t addr) { return addr & ~CACHE_MASK; }
-    static constexpr size_t CacheOffset(uint32_t addr) { return addr & CACHE_MASK; }
-    static constexpr size_t CacheRemaining(uint32_t addr) { return (~addr & CACHE_MASK) + 1; }
+    char* cacheData;
+    //! Word-aligned scratch buffer, can be used only while the bus is acquired
+    uint32_t* scratch;
+
+    bool busyErase = false;
+    bool useReadyPin = false, readyPinLevel;
+    GPIOPin readyPin;
+    uint32_t busyTypical;
+    mono_t busyStart;
+
+    //! Erase suspend/resume opcodes, zero if not supported
+    uint8_t opSuspend = 0, opResume = 0;
+    bool suspended = false;
+    //! Range of the erase in progress
+    uint32_t eraseStart = 0, eraseEnd = 0;
+    //! Minimum time between resuming and suspending an erase again
+    mono_t resumeInterval;
+    mono_t resumeTime;
+    WaitStats lastWait = {};
+    IOStats stats = {};
+
+    //! Deep power-down opcodes, zero if not supported
+    uint8_t opPowerDown = OP_POWER_DOWN, opReleasePowerDown = OP_RELEASE_POWER_DOWN;
+    bool poweredDown = false;
+    //! Set while a task waits for the device to wake up from deep power-down with the bus released
+    bool releasing = false;
+    //! Set while the task entering deep power-down is running
+    bool powerDownTask = false;
+    //! Time the device needs after release from deep power-down (tRES1)
+    mono_t releaseDelay;
+    //! Idle time before entering deep power-down in ms, zero if disabled
+    unsigned powerDownIdle = 0;
+    mono_t lastAccess = 0;
+
+    constexpr size_t CacheLineSize() const { return 1 << cacheLineBits; }
+    constexpr uint32_t CacheMask() const { return CacheLineSize() - 1; }
+    constexpr uint32_t CacheAddress(uint32_t addr) const { return addr & ~CacheMask(); }
+    constexpr size_t CacheOffset(uint32_t addr) const { return addr & CacheMask(); }
+    constexpr size_t CacheRemaining(uint32_t addr) const { return (~addr & CacheMask()) + 1; }
+    //! Gets the first line of the cache set to which the specified address belongs
+    Cache* CacheSet(uint32_t addr) const { return cache + ((addr >> cacheLineBits) & cacheSetMask) * cacheWays; }
+    //! Gets the part of the cache line corresponding to the specified address range
+    Span CacheSpan(const Cache& c, uint32_t addr, size_t length) const { return Span(c.data + CacheOffset(addr), std::min(length, CacheRemaining(addr))); }
+
+    //! Finds the cache line containing the specified address, NULL if not cached
+    Cache* FindCache(uint32_t addr) const;
+    //! Selects the least recently used line of the cache set to which the specified address belongs
+    Cache* EvictCache(uint32_t addr);
+    //! Updates the cached data after a write, @p data == NULL means the range is filled with @p value
+    void UpdateCache(uint32_t addr, size_t length, const char* data, uint8_t value = 0);
+    //! Updates the cached data after an erase
+    void EraseCache(uint32_t start, uint32_t end);
 
     async(ReadSFDP, uint32_t addr, Buffer buffer) { return async_forward(ReadSFDP, addr, buffer.Pointer(), buffer.Length()); }
     async(ReadSFDP, uint32_t addr, char* buffer, size_t length);
     async(ReadID);
-    async(EnsureCache, uint32_t addr);
+    async(EnsureCache, uint32_t addr, size_t length = 0);
     async(ReadImpl, uint32_t addr, char* buffer, size_t length);
     async(WriteImpl, uint32_t addr, const char* buffer, size_t length);
-    async(SyncAndAcquire);
+    //! Waits for the device to finish the current operation and acquires the bus
+    /*!
+     * If the operation is going to be a read from the specified range, an erase in progress
+     * outside of the range is suspended instead of waiting for its completion.
+     * A device in deep power-down is released, unless @p access is false (just waiting
+     * for completion), which also does not count as activity delaying the power-down.
+     */
+    async(SyncAndAcquire, uint32_t readStart = 0, uint32_t readEnd = 0, bool access = true);
+    //! Releases the device from deep power-down, the bus must be acquired
+    async(ReleasePowerDown);
+    //! Background task putting the idle device into deep power-down
+    async(PowerDownTask);
+    //! Resumes the erase suspended by a read
+    async(ResumeErase);
 
     void AddSectorType(SectorType sec);
+    //! Finds the largest sector type that can be erased at @p start without exceeding @p end, -1 if none
+    int LargestErase(uint32_t start, uint32_t end) const;
+    //! Gets the mask of smallest sectors covered by the sector of type @p type at @p offset from the beginning of a block
+    uint64_t SubsectorMask(uint32_t offset, int type) const
+        { return ((uint64_t(2) << ((1 << (sector[type].bits - sector[0].bits)) - 1)) - 1) << (offset >> sector[0].bits); }
+    //! Selects the sector type with the lowest typical time to erase the @p dirty smallest sectors of a block of type @p type
+    int PlanErase(int type, uint64_t dirty) const;
+    //! Erases a single sector of the specified type
+    async(EraseSector, uint32_t addr, int type);
+    //! Marks the device busy with an operation, @p typical is the typical erase time in ms
+    void SetBusy(bool erase = false, uint32_t typical = 0);
+    //! Calculates the delay before checking the device again during an erase
+    uint32_t EraseWait(uint32_t& backoff) const;
+    void SelectReadMode(const SFDPJEDEC& sfdp, const SFDP4BAIT* bait);
+
+    //! Builds the command header for the specified operation and address
+    Command MakeCommand(uint8_t op, uint32_t addr, size_t dummy = 0) const;
+    //! Builds the command header for reading from the specified address using the selected read mode
+    Command ReadCommand(uint32_t addr) const { return MakeCommand(readOp, addr, readDummy); }
 
     friend class SPIFlashStorage;
+    friend class BufferedSPIFlash;
 };
 
 }
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/SPIFlashQueue.cpp
+ */
+
+#include "SPIFlashQueue.h"
+
+namespace storage
+{
+
+SPIFlashQueue::Request* SPIFlashQueue::Select() const
+{
+    Request* best = NULL;
+    bool write = false;
+
+    for (Request* r = head; r; r = r->next)
+    {
+        if (r->op == Op::Other)
+        {
+            // nothing can overtake other operations, they go only when first
+            return best ? best : r;
+        }
+
+        if (r->op == Op::Write)
+        {
+            if (write)
+            {
+                // writes are executed in order
+                continue;
+            }
+            write = true;
+            if (ReadPending(*r))
+            {
+                continue;
+            }
+        }
+
+        if (!best || r->priority > best->priority ||
+            (r->priority == best->priority && r->op == Op::Read && best->op == Op::Write))
+        {
+            best = r;
+        }
+    }
+
+    return best;
+}
+
+bool SPIFlashQueue::ReadPending(const Request& write) const
+{
+    for (Request* r = head; r != &write; r = r->next)
+    {
+        if (r->op == Op::Read && r->Overlaps(write))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SPIFlashQueue::Remove(Request& r)
+{
+    for (Request** p = &head; *p; p = &(*p)->next)
+    {
+        if (*p == &r)
+        {
+            *p = r.next;
+            if (tail == &r.next)
+            {
+                tail = p;
+            }
+            return;
+        }
+    }
+}
+
+async(SPIFlashQueue::Begin, Request& r, Op op, uint8_t priority, uint32_t addr, size_t length, const void* data)
+async_def()
+{
+    r.next = NULL;
+    r.seq = seq++;
+    r.addr = addr;
+    r.length = length;
+    r.write = (const char*)data;
+    r.op = op;
+    r.priority = priority;
+    r.done = false;
+    *tail = &r;
+    tail = &r.next;
+
+    while (!r.done && (busy || Select() != &r))
+    {
+        async_yield();
+    }
+
+    if (r.done)
+    {
+        async_return(false);
+    }
+
+    busy = true;
+    async_return(true);
+}
+async_end
+
+size_t SPIFlashQueue::CollectReads(Request& r, Request** merged) const
+{
+    uint32_t start = r.addr, end = r.addr + r.length;
+    size_t n = 1;
+    merged[0] = &r;
+
+    // grow the burst as long as there are reads touching it
+    for (bool grown = true; grown && n < MERGE_MAX;)
+    {
+        grown = false;
+        for (Request* q = head; q && q->op != Op::Other && n < MERGE_MAX; q = q->next)
+        {
+            if (q->op != Op::Read || q->addr > end || q->addr + q->length < start)
+            {
+                continue;
+            }
+
+            size_t i = 0;
+            while (i < n && merged[i] != q)
+            {
+                i++;
+            }
+            if (i < n)
+            {
+                // already in the burst
+                continue;
+            }
+
+            merged[n++] = q;
+            start = std::min(start, q->addr);
+            end = std::max(end, uint32_t(q->addr + q->length));
+            grown = true;
+        }
+    }
+
+    // insertion sort, the burst is short
+    for (size_t i = 1; i < n; i++)
+    {
+        Request* q = merged[i];
+        size_t j = i;
+        for (; j && merged[j - 1]->addr > q->addr; j--)
+        {
+            merged[j] = merged[j - 1];
+        }
+        merged[j] = q;
+    }
+    return n;
+}
+
+void SPIFlashQueue::Overlay(const Request& r) const
+{
+    for (Request* w = head; w; w = w->next)
+    {
+        if (w->op != Op::Write || w->seq > r.seq || !w->Overlaps(r))
+        {
+            continue;
+        }
+
+        // programming can only clear bits, the data after the write is the AND of both
+        uint32_t start = std::max(r.addr, w->addr);
+        uint32_t end = std::min(r.addr + r.length, w->addr + w->length);
+        char* dst = r.read + (start - r.addr);
+        const char* src = w->write + (start - w->addr);
+        for (size_t i = 0; i < end - start; i++)
+        {
+            dst[i] &= src[i];
+        }
+    }
+}
+
+async(SPIFlashQueue::ExecuteRead, Request& r)
+async_def(
+    Request* merged[MERGE_MAX];
+    ByteStorage::ReadSegment seg[MERGE_MAX];
+    size_t n, segs;
+)
+{
+    f.n = CollectReads(r, f.merged);
+    f.segs = 0;
+    {
+        // each byte of the burst is read only once, into the first request covering it,
+        // so the segments are exactly adjacent and the storage can read them with a single command
+        uint32_t end = f.merged[0]->addr;
+        for (size_t i = 0; i < f.n; i++)
+        {
+            Request* q = f.merged[i];
+            if (q->addr + q->length > end)
+            {
+                uint32_t start = std::max(end, q->addr);
+                f.seg[f.segs++] = { start, Buffer(q->read + (start - q->addr), q->addr + q->length - start) };
+                end = q->addr + q->length;
+            }
+        }
+    }
+
+    await(storage.ReadV, f.seg, f.segs);
+
+    for (size_t i = 1; i < f.n; i++)
+    {
+        CopyOverlap(*f.merged[i], f.merged, i);
+    }
+
+    for (size_t i = 0; i < f.n; i++)
+    {
+        Overlay(*f.merged[i]);
+    }
+
+    for (size_t i = 0; i < f.n; i++)
+    {
+        if (f.merged[i] != &r)
+        {
+            // the waiting task just returns
+            f.merged[i]->done = true;
+            Remove(*f.merged[i]);
+            mergedReads++;
+        }
+    }
+}
+async_end
+
+void SPIFlashQueue::CopyOverlap(const Request& r, Request* const* preceding, size_t count) const
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        // the preceding requests are complete, the bytes not read into the request come from them
+        const Request* q = preceding[i];
+        uint32_t start = std::max(r.addr, q->addr);
+        uint32_t end = std::min(r.addr + r.length, q->addr + q->length);
+        if (start < end)
+        {
+            memcpy(r.read + (start - r.addr), q->read + (start - q->addr), end - start);
+        }
+    }
+}
+
+async(SPIFlashQueue::Port::ReadImpl, uint32_t addr, void* buffer, size_t length)
+async_def(
+    Request req;
+)
+{
+    stats.Count(IOStats::Read, length);
+    if (await(queue.Begin, f.req, Op::Read, priority, addr, length, buffer))
+    {
+        await(queue.ExecuteRead, f.req);
+        queue.End(f.req);
+    }
+}
+async_end
+
+async(SPIFlashQueue::Port::WriteImpl, uint32_t addr, const void* buffer, size_t length)
+async_def(
+    Request req;
+)
+{
+    stats.Count(IOStats::Write, length);
+    await(queue.Begin, f.req, Op::Write, priority, addr, length, buffer);
+    await(queue.storage.Write, addr, Span(buffer, length));
+    queue.End(f.req);
+}
+async_end
+
+async(SPIFlashQueue::Port::ReadToRegister, uint32_t addr, volatile void* reg, size_t length)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Read, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.ReadToRegister, addr, reg, length);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Read, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.ReadToPipe, pipe, addr, length, timeout);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Write, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.WriteFromPipe, pipe, addr, length, timeout);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::Fill, uint32_t addr, uint8_t value, size_t length)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Write, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.Fill, addr, value, length);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::IsAll, uint32_t addr, uint8_t value, size_t length)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Check, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.IsAll, addr, value, length);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::Erase, uint32_t addr, uint32_t length)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Erase, length);
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.Erase, addr, length);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::EraseFirst, uint32_t addr, uint32_t length)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    stats.Count(IOStats::Erase, SectorSize());
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.EraseFirst, addr, length);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::Flush)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.Flush);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+async(SPIFlashQueue::Port::Sync)
+async_def(
+    Request req;
+    intptr_t res;
+)
+{
+    await(queue.Begin, f.req, Op::Other, priority);
+    f.res = await(queue.storage.Sync);
+    queue.End(f.req);
+    async_return(f.res);
+}
+async_end
+
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/SPIFlashQueue.h
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include <storage/ByteStorage.h>
+
+namespace storage
+{
+
+//! Request queue scheduling the access of multiple tasks to a shared storage (usually a @ref SPIFlashStorage)
+/*!
+ * Each task accesses the storage using its own @ref Port with a priority.
+ * Requests are executed one at a time, the pending request with the highest
+ * priority goes first, preferring reads over writes of the same priority.
+ * Reads may overtake pending writes and are served with the pending write
+ * data applied, so they always see the effect of writes queued before them.
+ * All other operations (erases, fills, checks, pipe transfers) are executed
+ * strictly in order with respect to all requests.
+ *
+ * When a read is executed, other pending reads adjacent to (or overlapping)
+ * it are merged into a single @ref ByteStorage::ReadV burst reading each byte
+ * of their union once, overlapping parts are copied between the requests.
+ *
+ * Lower priority requests wait as long as higher priority ones keep coming.
+ */
+class SPIFlashQueue
+{
+    struct Request;
+
+public:
+    SPIFlashQueue(ByteStorage& storage)
+        : storage(storage) {}
+
+    //! Access to the queued storage with a fixed request priority
+    class Port : public ByteStorage
+    {
+    public:
+        Port(SPIFlashQueue& queue, uint8_t priority = 0)
+            : queue(queue), priority(priority) {}
+
+        //! Initializes the port geometry, must be called after the underlying storage is initialized
+        void Init() { Initialize(queue.storage.Size(), queue.storage.SectorSize()); }
+
+        constexpr uint8_t Priority() const { return priority; }
+
+    private:
+        SPIFlashQueue& queue;
+        uint8_t priority;
+
+        async(ReadImpl, uint32_t addr, void* buffer, size_t length) final override;
+        async(WriteImpl, uint32_t addr, const void* buffer, size_t length) final override;
+
+    public:
+        async(ReadToRegister, uint32_t addr, volatile void* reg, size_t length) final override;
+        async(ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+
+        async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+        async(Fill, uint32_t addr, uint8_t value, size_t length) final override;
+
+        async(IsAll, uint32_t addr, uint8_t value, size_t length) final override;
+        async(Erase, uint32_t addr, uint32_t length) final override;
+        async(EraseFirst, uint32_t addr, uint32_t length) final override;
+        async(Flush) final override;
+        async(Sync) final override;
+    };
+
+    //! Gets the number of reads served as part of a burst of another read
+    uint32_t MergedReads() const { return mergedReads; }
+
+private:
+    enum
+    {
+        //! Maximum number of reads merged into a single burst
+        MERGE_MAX = 8,
+    };
+
+    enum struct Op : uint8_t
+    {
+        Read,
+        Write,
+        Other,
+    };
+
+    struct Request
+    {
+        Request* next;
+        uint32_t seq;
+        uint32_t addr;
+        size_t length;
+        union
+        {
+            char* read;
+            const char* write;
+        };
+        Op op;
+        uint8_t priority;
+        bool done;
+
+        bool Overlaps(const Request& other) const { return addr < other.addr + other.length && other.addr < addr + length; }
+    };
+
+    ByteStorage& storage;
+    Request* head = NULL;
+    Request** tail = &head;
+    uint32_t seq = 0;
+    bool busy = false;
+    uint32_t mergedReads = 0;
+
+    //! Selects the next request to be executed
+    Request* Select() const;
+    //! Checks if an older pending read overlaps the write, which must wait for it
+    bool ReadPending(const Request& write) const;
+    //! Removes the request from the queue
+    void Remove(Request& r);
+    //! Queues the request and waits until it is selected for execution
+    //! @returns false if the request was served as part of another request in the meantime
+    async(Begin, Request& r, Op op, uint8_t priority, uint32_t addr = 0, size_t length = 0, const void* data = NULL);
+    //! Finishes the execution of the request, letting the next one proceed
+    void End(Request& r) { busy = false; Remove(r); }
+    //! Executes the read request, merged with other pending reads adjacent to it
+    async(ExecuteRead, Request& r);
+    //! Collects the pending reads to be merged with the request, sorted by address
+    size_t CollectReads(Request& r, Request** merged) const;
+    //! Copies the parts of a merged read that were read into the preceding requests of the burst
+    void CopyOverlap(const Request& r, Request* const* preceding, size_t count) const;
+    //! Applies the pending writes older than the read to the data read
+    void Overlay(const Request& r) const;
+};
+
+}
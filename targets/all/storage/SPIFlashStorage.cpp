@@ -29,6 +29,11 @@ async(SPIFlashStorage::ReadImpl, uint32_t addr, void* buffer, size_t length)
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    if (map)
+    {
+        return async_forward(Mapped, MappedOp::Read, addr, buffer, 0, length);
+    }
     return async_forward(flash.Read, start + addr, Buffer(buffer, length));
 }
 
@@ -36,6 +41,11 @@ async(SPIFlashStorage::ReadToRegister, uint32_t addr, volatile void* reg, size_t
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    if (map)
+    {
+        return async_forward(ReadToRegisterMapped, addr, reg, length);
+    }
     return async_forward(flash.ReadToRegister, start + addr, reg, length);
 }
 
@@ -43,6 +53,11 @@ async(SPIFlashStorage::ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t le
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
+    if (map)
+    {
+        return async_forward(ReadToPipeMapped, pipe, addr, length, timeout);
+    }
     return async_forward(flash.ReadToPipe, pipe, start + addr, length, timeout);
 }
 
@@ -51,6 +66,11 @@ async(SPIFlashStorage::WriteImpl, uint32_t addr, const void* buffer, size_t leng
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    if (map)
+    {
+        return async_forward(Mapped, MappedOp::Write, addr, buffer, 0, length);
+    }
     return async_forward(flash.Write, start + addr, Span(buffer, length));
 }
 
@@ -58,13 +78,50 @@ async(SPIFlashStorage::WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    if (map)
+    {
+        return async_forward(WriteFromPipeMapped, pipe, addr, length, timeout);
+    }
     return async_forward(flash.WriteFromPipe, pipe, start + addr, length, timeout);
 }
 
+async(SPIFlashStorage::ReadV, const ReadSegment* segments, size_t count)
+{
+    if (map)
+    {
+        // segments are read one by one, each of them translated and counted by ReadImpl
+        return async_forward(ByteStorage::ReadV, segments, count);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        stats.Count(IOStats::Read, segments[i].data.Length());
+    }
+    return async_forward(flash.ReadV, segments, count, start);
+}
+
+async(SPIFlashStorage::WriteV, const WriteSegment* segments, size_t count)
+{
+    if (map)
+    {
+        return async_forward(ByteStorage::WriteV, segments, count);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        stats.Count(IOStats::Write, segments[i].data.Length());
+    }
+    return async_forward(flash.WriteV, segments, count, start);
+}
+
 async(SPIFlashStorage::Fill, uint32_t addr, uint8_t value, size_t length)
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
+    if (map)
+    {
+        return async_forward(Mapped, MappedOp::Fill, addr, NULL, value, length);
+    }
     return async_forward(flash.Fill, start + addr, value, length);
 }
 
@@ -73,6 +130,11 @@ async(SPIFlashStorage::IsAll, uint32_t addr, uint8_t value, size_t length)
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Check, length);
+    if (map)
+    {
+        return async_forward(Mapped, MappedOp::IsAll, addr, NULL, value, length);
+    }
     return async_forward(flash.IsAll, start + addr, value, length);
 }
 
@@ -80,6 +142,11 @@ async(SPIFlashStorage::Erase, uint32_t addr, uint32_t length)
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Erase, length);
+    if (map)
+    {
+        return async_forward(Mapped, MappedOp::Erase, addr, NULL, 0, length);
+    }
     return async_forward(flash.Erase, start + addr, length);
 }
 
@@ -87,7 +154,120 @@ async(SPIFlashStorage::EraseFirst, uint32_t addr, uint32_t length)
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Erase, SectorSize());
+    if (map)
+    {
+        return async_forward(EraseFirstMapped, addr, length);
+    }
     return async_forward(flash.EraseFirst, start + addr, length);
 }
 
+async(SPIFlashStorage::EraseFirstMapped, uint32_t addr, uint32_t length)
+async_def()
+{
+    // physical sectors are not contiguous, erase just the first one
+    await(flash.Erase, PhysicalAddress(addr), SectorSize());
+    async_return(SectorAddress(addr) + SectorSize());
+}
+async_end
+
+async(SPIFlashStorage::Mapped, MappedOp op, uint32_t addr, const void* buffer, uint8_t value, size_t length)
+async_def(
+    size_t done, len;
+    uint32_t phys;
+)
+{
+    for (; f.done < length; f.done += f.len)
+    {
+        f.len = Contiguous(addr + f.done, length - f.done);
+        f.phys = PhysicalAddress(addr + f.done);
+
+        if (op == MappedOp::Read)
+        {
+            await(flash.Read, f.phys, Buffer((char*)buffer + f.done, f.len));
+        }
+        else if (op == MappedOp::Write)
+        {
+            await(flash.Write, f.phys, Span((const char*)buffer + f.done, f.len));
+        }
+        else if (op == MappedOp::Fill)
+        {
+            await(flash.Fill, f.phys, value, f.len);
+        }
+        else if (op == MappedOp::IsAll)
+        {
+            if (!await(flash.IsAll, f.phys, value, f.len))
+            {
+                async_return(false);
+            }
+        }
+        else
+        {
+            await(flash.Erase, f.phys, f.len);
+        }
+    }
+
+    async_return(true);
+}
+async_end
+
+async(SPIFlashStorage::ReadToRegisterMapped, uint32_t addr, volatile void* reg, size_t length)
+async_def(
+    size_t done, len;
+)
+{
+    for (; f.done < length; f.done += f.len)
+    {
+        f.len = Contiguous(addr + f.done, length - f.done);
+        await(flash.ReadToRegister, PhysicalAddress(addr + f.done), reg, f.len);
+    }
+}
+async_end
+
+async(SPIFlashStorage::ReadToPipeMapped, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    size_t done, len, part;
+    Timeout until;
+)
+{
+    // the timeout applies to the whole operation, not each sector
+    f.until = timeout.MakeAbsolute();
+    for (; f.done < length; f.done += f.len)
+    {
+        f.len = Contiguous(addr + f.done, length - f.done);
+        f.part = await(flash.ReadToPipe, pipe, PhysicalAddress(addr + f.done), f.len, f.until);
+        if (f.part < f.len)
+        {
+            // pipe timed out
+            async_return(f.done + f.part);
+        }
+    }
+
+    async_return(f.done);
+}
+async_end
+
+async(SPIFlashStorage::WriteFromPipeMapped, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout)
+async_def(
+    size_t done, len, part;
+    Timeout until;
+)
+{
+    // the timeout applies to the whole operation, not each sector
+    f.until = timeout.MakeAbsolute();
+    for (; f.done < length; f.done += f.len)
+    {
+        f.len = Contiguous(addr + f.done, length - f.done);
+        f.part = await(flash.WriteFromPipe, pipe, PhysicalAddress(addr + f.done), f.len, f.until);
+        if (f.part < f.len)
+        {
+            // pipe timed out
+            async_return(f.done + f.part);
+        }
+    }
+
+    async_return(f.done);
+}
+async_end
+
 }
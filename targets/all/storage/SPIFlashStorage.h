@@ -16,6 +16,11 @@
 namespace storage
 {
 
+//! ByteStorage representing a partition of a SPI flash memory
+/*!
+ * The partition statistics count the operations requested on the partition,
+ * device-level events (cache, busy waits, latencies) are collected by @ref SPIFlash::Stats
+ */
 class SPIFlashStorage : public ByteStorage
 {
 public:
@@ -26,9 +31,46 @@ public:
 
     constexpr uint32_t Offset() const { return start; }
 
+    //! Remaps the sectors of the partition onto arbitrary physical sectors of the flash
+    /*!
+     * @param map contains the index of the physical flash sector for each logical sector
+     * of the partition, allowing frequently erased sectors to be moved onto less worn
+     * physical sectors, possibly belonging to other partitions. The table is owned and
+     * persisted by the caller, who is also responsible for moving the contents of the
+     * sectors before updating it. Operations crossing sector boundaries are split into
+     * one flash operation per sector. Pass NULL to disable remapping.
+     */
+    void Remap(const uint16_t* map) { this->map = map; }
+    //! Translates an address in the partition to a physical flash address
+    uint32_t PhysicalAddress(uint32_t addr) const { return map ? (uint32_t(map[addr >> SectorSizeBits()]) << SectorSizeBits()) | (addr & SectorMask()) : start + addr; }
+
 private:
     SPIFlash& flash;
     uint32_t start;
+    const uint16_t* map = NULL;
+
+    //! Gets the length of the part of the range that maps to contiguous flash
+    size_t Contiguous(uint32_t addr, size_t length) { return map ? std::min(length, SectorRemaining(addr)) : length; }
+
+    enum struct MappedOp
+    {
+        Read,
+        Write,
+        Fill,
+        IsAll,
+        Erase,
+    };
+
+    //! Performs an operation on a remapped partition, split at sector boundaries
+    async(Mapped, MappedOp op, uint32_t addr, const void* buffer, uint8_t value, size_t length);
+    //! Erases the first sector of a range on a remapped partition
+    async(EraseFirstMapped, uint32_t addr, uint32_t length);
+    //! Reads a range of a remapped partition into a register, split at sector boundaries
+    async(ReadToRegisterMapped, uint32_t addr, volatile void* reg, size_t length);
+    //! Reads a range of a remapped partition into a pipe, split at sector boundaries
+    async(ReadToPipeMapped, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout);
+    //! Writes a range of a remapped partition from a pipe, split at sector boundaries
+    async(WriteFromPipeMapped, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout);
 
     async(ReadImpl, uint32_t addr, void* buffer, size_t length) final override;
     async(WriteImpl, uint32_t addr, const void* buffer, size_t length) final override;
@@ -38,6 +80,8 @@ public:
     async(ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout) final override;
 
     async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+    async(ReadV, const ReadSegment* segments, size_t count) final override;
+    async(WriteV, const WriteSegment* segments, size_t count) final override;
     async(Fill, uint32_t addr, uint8_t value, size_t length) final override;
 
     async(IsAll, uint32_t addr, uint8_t value, size_t length) final override;
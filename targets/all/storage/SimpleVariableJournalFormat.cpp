@@ -16,7 +16,7 @@ async_def(
 )
 {
     await(sector.Read, 0, f.ph);
-    info.firstRecord = sizeof(PageHeader);
+    info.firstRecord = FirstRecord();
     info.sequence = f.ph.sequence;
     if (Span(f.ph).IsAllOnes())
     {
@@ -42,6 +42,12 @@ async_def(
     RecordHeader hdr;
 )
 {
+    if (auto p = sectorRemaining.GetDirectPointer(0, sizeof(RecordHeader)))
+    {
+        // mapped storage, parse the header in place
+        async_return(ParseRecord(Span(p, sizeof(RecordHeader)), sectorInfo, info));
+    }
+
     await(sectorRemaining.Read, 0, f.hdr);
     info.payload = f.hdr.Size();
     info.nextRecord = info.payload + sizeof(RecordHeader);
@@ -61,13 +67,39 @@ async_def(
 }
 async_end
 
+intptr_t SimpleVariableJournalFormat::ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const
+{
+    RecordHeader hdr;
+    if (data.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    memcpy(&hdr, data.Pointer(), sizeof(hdr));
+    info.payload = hdr.Size();
+    info.nextRecord = info.payload + sizeof(RecordHeader);
+    if (hdr.IsEmpty())
+    {
+        info.state = RecordState::Empty;
+    }
+    else if (hdr.IsBad())
+    {
+        info.state = RecordState::Bad;
+    }
+    else
+    {
+        info.state = RecordState::Valid;
+    }
+    return sizeof(RecordHeader);
+}
+
 async(SimpleVariableJournalFormat::InitSector, const ByteStorageSpan& sector, SectorInfo& info)
 async_def()
 {
     info.sequence = (info.IsValid() ? info.sequence : 0) + 1;
     await(sector.Write, offsetof(PageHeader, sequence), info.sequence);
     await(sector.Write, offsetof(PageHeader, magic), magic);
-    info.firstRecord = sizeof(PageHeader);
+    info.firstRecord = FirstRecord();
     info.state = SectorState::Valid;
 }
 async_end
@@ -80,7 +112,7 @@ async_def(
     // limit the payload to theoretical maximum
     f.hdr.size = std::min(payload, size_t(0x7FFF));
 
-    if ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) == sizeof(PageHeader))
+    if ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) == FirstRecord())
     {
         // further limit the payload to sector maximum
         f.hdr.size = std::min(size_t(f.hdr.size), sectorRemaining.Size() - sizeof(RecordHeader));
@@ -110,3 +142,41 @@ async_def()
     await(payload.Storage().Write, payload.Offset() - 2, (const uint16_t[]){0x7FFF});
 }
 async_end
+
+intptr_t SimpleVariableJournalFormat::PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload)
+{
+    RecordHeader hdr;
+    if (header.Length() < sizeof(hdr))
+    {
+        return -1;
+    }
+
+    // the same limits as InitRecord
+    hdr.size = std::min(payload, size_t(0x7FFF));
+
+    if ((sectorRemaining.Offset() & sectorRemaining.Storage().SectorMask()) == FirstRecord())
+    {
+        hdr.size = std::min(size_t(hdr.size), sectorRemaining.Size() - sizeof(RecordHeader));
+    }
+
+    if (sizeof(RecordHeader) + hdr.size > sectorRemaining.Size())
+    {
+        info.state = RecordState::Bad;
+        return 0;
+    }
+
+    hdr.size |= 0x8000;     // mark as unfinished
+    memcpy(header.Pointer(), &hdr, sizeof(hdr));
+    info.payload = hdr.Size();
+    info.nextRecord = sizeof(RecordHeader) + info.payload;
+    info.state = RecordState::Valid;
+    return sizeof(RecordHeader);
+}
+
+void SimpleVariableJournalFormat::PrepareCommit(Buffer record, const RecordInfo& info)
+{
+    // the same bits as CommitRecord, clearing the top bit in the length field
+    RecordHeader hdr = { 0x7FFF };
+    memset(record.Pointer(), 0xFF, info.NextRecordOffset());
+    memcpy(record.Pointer(), &hdr, sizeof(hdr));
+}
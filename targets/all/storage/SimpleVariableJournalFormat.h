@@ -18,11 +18,13 @@ namespace storage
 class SimpleVariableJournalFormat : public JournalFormat
 {
 public:
-    SimpleVariableJournalFormat(uint32_t magic)
-        : magic(magic) {}
+    //! Creates the format, optionally reserving an erase counter after the header of each sector
+    SimpleVariableJournalFormat(uint32_t magic, bool countErases = false)
+        : magic(magic), countErases(countErases) {}
 
 private:
     uint32_t magic;
+    bool countErases;
 
     struct PageHeader
     {
@@ -39,11 +41,17 @@ private:
         constexpr size_t Size() const { return size & 0x7FFF; }
     };
 
+    size_t FirstRecord() const { return sizeof(PageHeader) + (countErases ? sizeof(uint32_t) : 0); }
+
     virtual async(ScanSector, const ByteStorageSpan& sector, SectorInfo& info, const SectorInfo* following) const final override;
     virtual async(ScanRecord, const ByteStorageSpan& sectorRemaining, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
+    virtual intptr_t ParseRecord(Span data, const SectorInfo& sectorInfo, RecordInfo& info) const final override;
     virtual async(InitSector, const ByteStorageSpan& sector, SectorInfo& info) final override;
     virtual async(InitRecord, const ByteStorageSpan& sectorRemaining, RecordInfo& info, size_t payload) final override;
     virtual async(CommitRecord, const ByteStorageSpan& payload) final override;
+    virtual intptr_t PrepareRecord(const ByteStorageSpan& sectorRemaining, Buffer header, RecordInfo& info, size_t payload) final override;
+    virtual void PrepareCommit(Buffer record, const RecordInfo& info) final override;
+    virtual size_t EraseCounterOffset() const final override { return countErases ? sizeof(PageHeader) : 0; }
 };
 
 }
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/tests/benchmark/JournalBenchmark.cpp
+ *
+ * Repeatable JournalStorage workloads reporting the storage operations,
+ * simulated busy cycles and bytes moved per logical operation.
+ * The workloads only report, they do not fail on the numbers.
+ */
+
+#include <testrunner/TestCase.h>
+
+#include <base/ID.h>
+
+#include <storage/JournalStorage.h>
+#include <storage/SimpleVariableJournalFormat.h>
+#include <storage/TestByteStorage.h>
+
+#define MYDBG(...)  DBGCL("Benchmark", __VA_ARGS__)
+
+using namespace storage;
+
+namespace
+{
+
+enum
+{
+    //! Seed used for all simulated timings, keeps the reported cycles repeatable between runs
+    SEED = 12345,
+    RING_SIZE = 16384,
+};
+
+//! Reports the operations performed since the last reset, divided by the number of logical operations
+void Report(const char* name, TestByteStorage& store, unsigned ops)
+{
+    auto& s = store.Stats();
+    auto& r = s.op[IOStats::Read];
+    auto& w = s.op[IOStats::Write];
+    ops = nonzero(ops, 1u);
+    MYDBG("%s: %d ops, R:%d W:%d C:%d E:%d, %d cycles, %d B read, %d B written",
+        name, ops, r.count, w.count, s.op[IOStats::Check].count, s.op[IOStats::Erase].count,
+        uint32_t(s.busyTime), r.bytes, w.bytes);
+    MYDBG("%s: per op %d cycles, %d B read, %d B written",
+        name, uint32_t(s.busyTime / ops), r.bytes / ops, w.bytes / ops);
+    store.ResetStats();
+}
+
+}
+
+TEST_CASE("01 Scan Empty")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(RING_SIZE), format(ID("TEST")));
+
+    async(Run)
+    async_def()
+    {
+        store.Seed(SEED);
+
+        await(Scan);
+        // one header read per sector
+        Report("Scan (empty)", store, 1);
+
+        await(FastScan);
+        // sector 0 is empty, falls back to the full scan
+        Report("FastScan (empty)", store, 1);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("02 Append Small Records")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(RING_SIZE), format(ID("TEST")));
+
+    RecordWriter rw;
+
+    int i;
+
+    async(Run)
+    async_def()
+    {
+        store.Seed(SEED);
+        await(Scan);
+        store.ResetStats();
+
+        for (i = 0; i < 2000; i++)
+        {
+            await(BeginWrite, rw, sizeof(i) + i % 16);
+            await(rw.Write, 0, i);
+            await(EndWrite, rw);
+        }
+        // header, payload and commit, sector initialization amortized over ~75 records
+        Report("Append (4-19 B)", store, 2000);
+
+        for (i = 0; i < 2000; i++)
+        {
+            await(Write, i);
+        }
+        // header and payload vector, commit, ~170 records per sector
+        Report("Write (4 B)", store, 2000);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("03 Scan Full And Wrapped")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(RING_SIZE), format(ID("TEST")));
+
+    int i;
+
+    async(Run)
+    async_def()
+    {
+        store.Seed(SEED);
+        await(Scan);
+
+        // fill the ring up to the last sector without wrapping around
+        for (i = 0; LastSectorAddress() < store.Size() - store.SectorSize(); i++)
+        {
+            await(Write, i);
+        }
+
+        store.ResetStats();
+        await(Scan);
+        // all headers, the records of the last sector and the headers again backwards
+        Report("Scan (full)", store, 1);
+
+        await(FastScan);
+        // log2 of the sector count probes instead of all the headers
+        Report("FastScan (full)", store, 1);
+
+        // wrap around to the middle of the ring
+        while (LastSectorAddress() != store.Size() / 2)
+        {
+            await(Write, i);
+            i++;
+        }
+
+        store.ResetStats();
+        await(Scan);
+        Report("Scan (wrapped)", store, 1);
+
+        await(FastScan);
+        // both binary searches and the boundary checks
+        Report("FastScan (wrapped)", store, 1);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("04 Enumeration")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(RING_SIZE), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+
+    int i, n;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        store.Seed(SEED);
+        await(Scan);
+
+        // enough to wrap around the ring
+        for (i = 0; i < 4000; i++)
+        {
+            await(Write, i);
+        }
+
+        store.ResetStats();
+        n = 0;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                n++;
+            }
+        }
+        // record header and payload, sector headers amortized
+        Report("Forward enumeration", store, n);
+
+        AssertLessThan(0, n);
+        i = n;
+        n = 0;
+        EnumerateSectors(se);
+        while (await(PreviousSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                n++;
+            }
+        }
+        Report("Reverse enumeration", store, n);
+
+        AssertEqual(n, i);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("05 Sector Rollover")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(RING_SIZE), format(ID("TEST")));
+
+    int i;
+
+    async(Run)
+    async_def()
+    {
+        store.Seed(SEED);
+        await(Scan);
+
+        // go around the ring twice, so every rollover erases a used sector
+        for (i = 0; i < 2 * RING_SIZE / 1024; i++)
+        {
+            await(Write, i);
+            await(CloseSector);
+        }
+
+        store.ResetStats();
+        for (i = 0; i < 100; i++)
+        {
+            await(Write, i);
+            await(CloseSector);
+        }
+        // the dropped sector header, erase check, erase, sector and record initialization
+        Report("Rollover", store, 100);
+    }
+    async_end
+}
+async_test_end
@@ -10,8 +10,15 @@
 
 #include <base/ID.h>
 
+#include <io/Pipe.h>
+
 #include <storage/JournalStorage.h>
+#include <storage/JournalKeyValueStore.h>
+#include <storage/DeltaJournal.h>
 #include <storage/SimpleVariableJournalFormat.h>
+#include <storage/FixedRecordJournalFormat.h>
+#include <storage/ChecksumJournalFormat.h>
+#include <storage/MultiStreamJournalFormat.h>
 #include <storage/TestByteStorage.h>
 
 using namespace storage;
@@ -19,6 +26,142 @@ using namespace storage;
 namespace
 {
 
+//! Verifies records passed to JournalStorage::ReadRecords
+struct RecordChecker
+{
+    int next = 0, records = 0, errors = 0, skip = -1;
+
+    bool Check(const JournalStorage::RecordEnumerator& re, Span data)
+    {
+        int rec;
+        if (next == skip)
+        {
+            next++;
+        }
+        if (data.Length() != sizeof(rec) + next % 50 || re.Length() != data.Length())
+        {
+            errors++;
+        }
+        memcpy(&rec, data.Pointer(), sizeof(rec));
+        if (rec != next)
+        {
+            errors++;
+        }
+        next++;
+        records++;
+        return true;
+    }
+};
+
+//! Retains records with the specified value during compaction
+struct Retainer
+{
+    int value, calls = 0;
+
+    bool Keep(const JournalStorage::RecordEnumerator& re, Span data)
+    {
+        int rec;
+        calls++;
+        memcpy(&rec, data.Pointer(), sizeof(rec));
+        return rec == value;
+    }
+};
+
+//! Retains and verifies records filled with a pattern derived from their value
+struct PatternChecker
+{
+    int records = 0, errors = 0;
+
+    static size_t Fill(uint8_t* data, int value)
+    {
+        size_t len = sizeof(value) + value % 20;
+        memset(data, uint8_t(value), len);
+        memcpy(data, &value, sizeof(value));
+        return len;
+    }
+
+    bool Keep(const JournalStorage::RecordEnumerator& re, Span data)
+    {
+        int rec;
+        memcpy(&rec, data.Pointer(), sizeof(rec));
+        return rec % 4 == 0;
+    }
+
+    bool Check(const JournalStorage::RecordEnumerator& re, Span data)
+    {
+        uint8_t expect[sizeof(int) + 20];
+        int rec;
+        memcpy(&rec, data.Pointer(), sizeof(rec));
+        if (data.Length() != Fill(expect, rec) || memcmp(data.Pointer(), expect, data.Length()))
+        {
+            errors++;
+        }
+        records++;
+        return true;
+    }
+};
+
+//! Prefixes records streamed by JournalStorage::ReadRecordsToPipe with their length
+struct Framer
+{
+    size_t Frame(const JournalStorage::RecordEnumerator& re, Buffer buf)
+    {
+        *(uint8_t*)buf.Pointer() = uint8_t(re.Length());
+        return 1;
+    }
+};
+
+//! Consumes everything written into a pipe from its own task until stopped
+struct PipeDrain
+{
+    io::Pipe* pipe;
+    size_t bytes;
+    bool stop;
+
+    void Start(io::Pipe& pipe)
+    {
+        this->pipe = &pipe;
+        bytes = 0;
+        stop = false;
+        kernel::Task::Run(*this, &PipeDrain::Run);
+    }
+
+    async(Run)
+    async_def()
+    {
+        while (!stop)
+        {
+            {
+                io::PipeReader reader(*pipe);
+                while (reader.Available())
+                {
+                    size_t n = reader.GetSpan().Length();
+                    reader.Advance(n);
+                    bytes += n;
+                }
+            }
+            async_yield();
+        }
+    }
+    async_end
+};
+
+//! Verifies samples passed to DeltaJournalReader::ReadRecords
+struct SampleChecker
+{
+    int next = 0, errors = 0;
+
+    bool Check(const JournalStorage::RecordEnumerator& re, const int32_t* sample)
+    {
+        if (sample[0] != next || sample[1] != 1000 - 3 * next)
+        {
+            errors++;
+        }
+        next++;
+        return true;
+    }
+};
+
 TEST_CASE("01 Simple Writes")
 async_test : JournalStorage
 {
@@ -208,4 +351,1116 @@ async_test : JournalStorage
 }
 async_test_end
 
+TEST_CASE("04 Pre-Erase")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+
+    int i;
+    int rec;
+    int first;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 500; i++)
+        {
+            await(Write, i);
+            await(PreErase, 2);
+            AssertEqual(PreErasedSectors(), size_t(2));
+        }
+
+        first = -1;
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (first < 0)
+                {
+                    first = i = rec;
+                }
+                AssertEqual(i, rec);
+                i++;
+            }
+        }
+
+        AssertLessThan(0, first);
+        AssertEqual(i, 500);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("05 Fast Scan")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    JournalStorage fast;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")), fast(store, format));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+
+    int i;
+    int rec;
+    int first;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 2000; i++)
+        {
+            await(Write, i);
+
+            if (i % 300 == 0)
+            {
+                AssertEqual(bool(await(fast.FastScan)), true);
+                AssertEqual(fast.LastSectorAddress(), LastSectorAddress());
+            }
+        }
+
+        AssertEqual(bool(await(fast.FastScan)), true);
+        AssertEqual(fast.LastSectorAddress(), LastSectorAddress());
+        await(fast.Write, i);
+
+        first = -1;
+
+        fast.EnumerateSectors(se);
+        while (await(fast.NextSector, se))
+        {
+            fast.EnumerateRecords(re, se);
+            while (await(fast.NextRecord, re, rec))
+            {
+                if (first < 0)
+                {
+                    first = i = rec;
+                }
+                AssertEqual(i, rec);
+                i++;
+            }
+        }
+
+        AssertLessThan(0, first);
+        AssertEqual(i, 2001);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("06 Sector Table")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+
+    int i;
+    int rec;
+    int first;
+    int sectors;
+
+    async(Run)
+    async_def()
+    {
+        AssertEqual(EnableSectorTable(), true);
+        await(Scan);
+
+        for (i = 0; i < 2000; i++)
+        {
+            await(Write, i);
+        }
+
+        first = -1;
+        sectors = 0;
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            sectors++;
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (first < 0)
+                {
+                    first = i = rec;
+                }
+                AssertEqual(i, rec);
+                i++;
+            }
+        }
+
+        AssertLessThan(0, first);
+        AssertEqual(i, 2000);
+
+        // walk back, the first record of each sector must be lower than the previous one
+        i = 2000;
+        EnumerateSectors(se);
+        while (await(PreviousSector, se))
+        {
+            sectors--;
+            EnumerateRecords(re, se);
+            AssertEqual(bool(await(NextRecord, re, rec)), true);
+            AssertLessThan(rec, i);
+            i = rec;
+        }
+
+        AssertEqual(i, first);
+        AssertEqual(sectors, 0);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("07 Bulk Reads")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    RecordWriter rw;
+    RecordChecker checker;
+    char buf[128];
+
+    int i;
+    int rec;
+    uint32_t big;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 200; i++)
+        {
+            // every 40th record is too big for the buffer
+            await(BeginWrite, rw, i % 40 == 39 ? 200 : sizeof(i) + i % 50);
+            await(rw.Write, 0, i);
+            await(EndWrite, rw);
+        }
+
+        big = ~0u;
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            for (;;)
+            {
+                await(ReadRecords, re, buf, GetDelegate(&checker, &RecordChecker::Check));
+                if (re.Length() <= sizeof(buf) || re.Address() == big)
+                {
+                    break;
+                }
+
+                // oversized record left for us
+                big = re.Address();
+                await(ReadRecord, re, Buffer(&rec, sizeof(rec)));
+                AssertEqual(rec, checker.next);
+                checker.next++;
+            }
+        }
+
+        AssertEqual(checker.errors, 0);
+        AssertEqual(checker.next, 200);
+        AssertEqual(checker.records, 200 - 200 / 40);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("08 Batch Writes")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    char buf[64];
+    int values[7];
+    Span records[7];
+
+    int i, n;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        store.ResetStats();
+
+        for (i = 0; i < 490; i += n)
+        {
+            for (n = 0; n < 7; n++)
+            {
+                values[n] = i + n;
+                records[n] = values[n];
+            }
+            AssertEqual(int(await(WriteBatch, records, 7, buf)), 7);
+        }
+
+        // the commit pass programs only the headers, not the whole batch again,
+        // and all headers in a page with a single program operation
+        AssertLessThan(store.Stats().op[IOStats::Write].bytes, uint32_t(490 * 2 * (sizeof(int) + 2) * 3 / 4));
+        AssertLessThan(store.Stats().op[IOStats::Write].count, uint32_t(490 / 7 * 3));
+
+        i = 0;
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                AssertEqual(i, rec);
+                i++;
+            }
+        }
+
+        AssertEqual(i, 490);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("09 Fixed Records")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    FixedRecordJournalFormat format;
+    JournalStorage other;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST"), sizeof(int)), other(store, format));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    RecordWriter rw;
+
+    int i;
+    int rec;
+    int first;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 1000; i++)
+        {
+            if (i & 1)
+            {
+                await(Write, i);
+            }
+            else
+            {
+                // abandoned records occupy a slot but are skipped
+                await(BeginWrite, rw, sizeof(i));
+                await(rw.Write, 0, i);
+            }
+        }
+
+        // a fresh instance must find the free slot
+        await(other.Scan);
+        i = 1001;
+        await(other.Write, i);
+
+        i = 1;
+
+        other.EnumerateSectors(se);
+        while (await(other.NextSector, se))
+        {
+            other.EnumerateRecords(re, se);
+            while (await(other.NextRecord, re, rec))
+            {
+                AssertEqual(i, rec);
+                i += 2;
+            }
+        }
+
+        AssertEqual(i, 1003);
+
+        // seek within the second sector
+        other.EnumerateSectors(se);
+        await(other.NextSector, se);
+        await(other.NextSector, se);
+        other.EnumerateRecords(re, se);
+        AssertEqual(bool(await(other.NextRecord, re, first)), true);
+        other.EnumerateRecords(re, se);
+        AssertEqual(bool(await(other.SeekRecord, re, 20)), true);
+        AssertEqual(bool(await(other.NextRecord, re, rec)), true);
+        AssertEqual(rec, first + 20);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("10 Seek")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    JournalStorage other;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")), other(store, format));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    Cursor cursor;
+
+    int i;
+    int rec;
+    int first;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 2000; i++)
+        {
+            await(Write, i);
+        }
+
+        // remember the position after record 1500
+        first = -1;
+        EnumerateSectors(se);
+        while (first < 0 && await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (rec == 1500)
+                {
+                    cursor = GetCursor(re);
+                    first = rec;
+                    break;
+                }
+            }
+        }
+        AssertEqual(first, 1500);
+
+        // resume using a fresh instance
+        await(other.Scan);
+        AssertEqual(bool(await(other.Seek, se, re, cursor)), true);
+        i = 1501;
+        do
+        {
+            while (await(other.NextRecord, re, rec))
+            {
+                AssertEqual(i, rec);
+                i++;
+            }
+            if (await(other.NextSector, se))
+            {
+                other.EnumerateRecords(re, se);
+            }
+        } while (se);
+
+        AssertEqual(i, 2000);
+
+        // overwritten position starts at the first record
+        cursor.sequence -= 100;
+        AssertEqual(bool(await(other.Seek, se, re, cursor)), false);
+        AssertEqual(bool(await(other.NextRecord, re, rec)), true);
+        AssertLessThan(0, rec);
+        AssertLessThan(rec, 1500);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("11 Checksums")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    ChecksumJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST"), true));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    RecordWriter rw;
+    RecordChecker checker;
+    PipeDrain drain;
+    io::Pipe pipe;
+    char buf[256];
+    uint8_t zero;
+
+    int i;
+    int rec;
+    size_t n, bytes;
+
+    async(Run)
+    async_def()
+    {
+        AssertEqual(ChecksumJournalFormat::Crc32(0, Span("123456789", 9)), 0xCBF43926u);
+
+        await(Scan);
+
+        bytes = 0;
+        for (i = 0; i < 150; i++)
+        {
+            await(BeginWrite, rw, sizeof(i) + i % 50);
+            await(rw.Write, 0, i);
+            await(EndWrite, rw);
+            bytes += sizeof(i) + i % 50;
+        }
+
+        // corrupt the payload of record 60
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (rec == 60)
+                {
+                    zero = 0;
+                    await(store.Write, re.Address(), zero);
+                }
+            }
+        }
+
+        checker.skip = 60;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            await(ReadRecords, re, buf, GetDelegate(&checker, &RecordChecker::Check));
+        }
+
+        AssertEqual(checker.errors, 0);
+        AssertEqual(checker.next, 150);
+        AssertEqual(checker.records, 149);
+
+        // streamed records are checksummed on their way to the pipe, each byte is read once
+        store.ResetStats();
+        drain.Start(pipe);
+        n = await(ReadRecordsToPipe, se, re, io::PipeWriter(pipe));
+        while (drain.bytes < bytes)
+        {
+            async_yield();
+        }
+        drain.stop = true;
+        AssertEqual(n, size_t(149));
+        AssertEqual(store.Stats().badRecords, uint32_t(1));
+        AssertLessThan(store.Stats().op[IOStats::Read].bytes, uint32_t(bytes + 150 * 12 + 8 * 32));
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("12 Streams")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    MultiStreamJournalFormat format;
+    JournalStorage other;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")), other(store, format));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+
+    int i, n, sectors;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        // two interleaved streams, a single record in a third one
+        for (i = 0; i < 300; i++)
+        {
+            await(Write, i, i == 100 ? 2 : i % 2);
+        }
+
+        n = 0;
+        EnumerateSectors(se, 1);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                AssertEqual(rec % 2, 1);
+                AssertEqual(re.Stream(), 1u);
+                n++;
+            }
+        }
+        AssertEqual(n, 150);
+
+        n = sectors = 0;
+        EnumerateSectors(se, 2);
+        while (await(NextSector, se))
+        {
+            sectors++;
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                AssertEqual(rec, 100);
+                n++;
+            }
+        }
+        AssertEqual(sectors, 1);
+        AssertEqual(n, 1);
+
+        // a single scan recovers the heads of all streams
+        AssertEqual(other.EnableStreamHeads(), true);
+        await(other.Scan);
+        AssertEqual(other.StreamHead(se, 2), true);
+        other.EnumerateRecords(re, se);
+        AssertEqual(bool(await(other.NextRecord, re, rec)), true);
+        AssertEqual(rec, 100);
+        AssertEqual(other.StreamHead(se, 0), true);
+        AssertEqual(se.Address(), other.LastSectorAddress());
+        AssertEqual(other.StreamHead(se, 3), false);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("13 Compaction")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    Retainer retainer;
+    char buf[256];
+
+    int i, n;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        retainer.value = -1;
+        EnableCompaction(GetDelegate(&retainer, &Retainer::Keep), buf);
+
+        // a single long-lived record followed by enough records to wrap the ring several times
+        await(Write, retainer.value);
+        for (i = 0; i < 5000; i++)
+        {
+            await(Write, i);
+        }
+
+        n = 0;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (rec == retainer.value)
+                {
+                    n++;
+                }
+            }
+        }
+
+        AssertLessThan(0, retainer.calls);
+        AssertLessThan(0, n);
+        AssertLessThan(n, 3);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("14 Key-Value Store")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    JournalKeyValueStore kv;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")), kv(*this, 256));
+
+    char buf[256];
+    uint32_t i;
+    int value;
+
+    async(Run)
+    async_def()
+    {
+        await(kv.Scan);
+        AssertEqual(kv.Count(), size_t(0));
+
+        for (i = 1; i <= 10; i++)
+        {
+            value = i * 10;
+            await(kv.Set, i, Span(&value, sizeof(value)));
+        }
+        value = 55;
+        await(kv.Set, 5, Span(&value, sizeof(value)));
+        await(kv.Delete, 7);
+
+        // the index is rebuilt from the journal
+        await(kv.Scan);
+        AssertEqual(kv.Count(), size_t(10));
+        AssertEqual(bool(kv.Overflow()), false);
+
+        value = 0;
+        AssertEqual(int(await(kv.Get, 5, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, 55);
+        AssertEqual(int(await(kv.Get, 3, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, 30);
+        AssertEqual(int(await(kv.Get, 7, Buffer(&value, sizeof(value)))), 0);
+        AssertEqual(int(await(kv.Get, 11, Buffer(&value, sizeof(value)))), 0);
+
+        // keep rewriting a single key, wrapping the ring several times
+        kv.EnableCompaction(buf);
+        for (i = 0; i < 5000; i++)
+        {
+            value = i;
+            await(kv.Set, 100, Span(&value, sizeof(value)));
+        }
+
+        AssertEqual(int(await(kv.Get, 100, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, 4999);
+        AssertEqual(int(await(kv.Get, 5, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, 55);
+        AssertEqual(int(await(kv.Get, 7, Buffer(&value, sizeof(value)))), 0);
+
+        // relocated values survive a rescan
+        await(kv.Scan);
+        AssertEqual(int(await(kv.Get, 10, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, 100);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("15 Erase Counters")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST"), true));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    WearStats wear;
+
+    int i, n;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        await(ReadWear, wear);
+        AssertEqual(wear.sectors, 0u);
+
+        // wrap the ring several times
+        for (i = 0; i < 5000; i++)
+        {
+            await(Write, i);
+        }
+        await(PreErase, 2);
+
+        await(ReadWear, wear);
+        AssertEqual(wear.sectors, 8u);
+        AssertLessThan(0u, wear.minErases);
+        AssertLessThan(wear.maxErases - wear.minErases, 2u);
+
+        // sectors holding just the counter are still empty, records follow the counter
+        await(Scan);
+        await(Write, i);
+        AssertLessThan(0, int(await(ReadEraseCount, LastSectorAddress())));
+
+        n = -1;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                if (n >= 0)
+                {
+                    AssertEqual(rec, n + 1);
+                }
+                n = rec;
+            }
+        }
+        AssertEqual(n, 5000);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("16 Delta Records")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    char block[64];
+    DeltaJournalWriter writer;
+    DeltaJournalReader reader;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")),
+        writer(*this, 2, block), reader(*this, 2));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    SampleChecker checker;
+    char buf[256];
+    int32_t sample[2];
+
+    int i, n;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 200; i++)
+        {
+            sample[0] = i;
+            sample[1] = 1000 - 3 * i;
+            await(writer.Write, sample);
+        }
+        await(writer.Flush);
+        AssertEqual(writer.Pending(), size_t(0));
+
+        n = 0;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re))
+            {
+                n++;
+            }
+        }
+
+        // two bytes per sample, many samples per record
+        AssertLessThan(0, n);
+        AssertLessThan(n, 20);
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            await(reader.ReadRecords, re, buf, GetDelegate(&checker, &SampleChecker::Check));
+        }
+
+        AssertEqual(checker.next, 200);
+        AssertEqual(checker.errors, 0);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("17 Mapped Storage")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    RecordWriter rw;
+    RecordChecker checker;
+    char buf[64];
+
+    int i, n;
+    int rec;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        for (i = 0; i < 200; i++)
+        {
+            await(BeginWrite, rw, sizeof(i) + i % 50);
+            await(rw.Write, 0, i);
+            await(EndWrite, rw);
+        }
+
+        // the same journal read through the mapped path
+        store.MakeMapped();
+        await(Scan);
+
+        n = 0;
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            while (await(NextRecord, re, rec))
+            {
+                AssertEqual(MappedRecord(re).Length(), sizeof(rec) + n % 50);
+                AssertEqual(memcmp(MappedRecord(re).Pointer(), &rec, sizeof(rec)), 0);
+                n++;
+            }
+        }
+        AssertEqual(n, 200);
+
+        store.ResetStats();
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            await(ReadRecords, re, buf, GetDelegate(&checker, &RecordChecker::Check));
+        }
+
+        // records are parsed in place, only sector headers are read
+        AssertEqual(checker.records, 200);
+        AssertEqual(checker.errors, 0);
+        AssertLessThan(store.Stats().op[IOStats::Read].count, uint32_t(checker.records));
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("18 Compaction Payloads")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    PatternChecker checker;
+    uint8_t data[sizeof(int) + 20];
+    char buf[64];
+
+    int i;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        // a small buffer makes the bulk reads refill it during every batch
+        EnableCompaction(GetDelegate(&checker, &PatternChecker::Keep), buf);
+
+        for (i = 0; i < 3000; i++)
+        {
+            await(Write, Span(data, PatternChecker::Fill(data, i)));
+        }
+
+        EnumerateSectors(se);
+        while (await(NextSector, se))
+        {
+            EnumerateRecords(re, se);
+            await(ReadRecords, re, buf, GetDelegate(&checker, &PatternChecker::Check));
+        }
+
+        // relocated copies carry their original payloads
+        AssertLessThan(0, checker.records);
+        AssertEqual(checker.errors, 0);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("19 Pipe Resume")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    RecordWriter rw;
+    Framer framer;
+    io::Pipe pipe;
+    uint8_t out[1024];
+
+    int i, calls;
+    size_t n, len;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+        for (i = 0; i < 20; i++)
+        {
+            await(BeginWrite, rw, sizeof(i) + i % 50);
+            await(rw.Write, 0, i);
+            await(EndWrite, rw);
+        }
+
+        // every call stops in the middle of a record and the next one resumes it
+        len = 0;
+        for (n = 0, calls = 0; n < 20; calls++)
+        {
+            store.StallPipe(7);
+            n += await(ReadRecordsToPipe, se, re, io::PipeWriter(pipe), GetDelegate(&framer, &Framer::Frame));
+            AssertLessThan(calls, 1000);
+
+            {
+                io::PipeReader reader(pipe);
+                while (reader.Available())
+                {
+                    Span span = reader.GetSpan().Left(sizeof(out) - len);
+                    memcpy(out + len, span.Pointer(), span.Length());
+                    reader.Advance(span.Length());
+                    len += span.Length();
+                }
+            }
+        }
+        AssertLessThan(20, calls);
+
+        // the stream contains each record exactly once
+        n = 0;
+        for (i = 0; i < 20; i++)
+        {
+            AssertEqual(size_t(out[n]), sizeof(i) + i % 50);
+            AssertEqual(memcmp(out + n + 1, &i, sizeof(i)), 0);
+            n += 1 + out[n];
+        }
+        AssertEqual(n, len);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("20 Key-Value Wrap")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    JournalKeyValueStore kv;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")), kv(*this, 256));
+
+    uint32_t i, addr;
+    int value;
+    bool dropped;
+
+    async(Run)
+    async_def()
+    {
+        await(kv.Scan);
+
+        value = 11;
+        await(kv.Set, 1, Span(&value, sizeof(value)));
+        addr = LastRecordAddress();
+
+        // without compaction, the sector holding the key is dropped and reused for other records
+        dropped = false;
+        for (i = 0; i < 5000 && !(dropped && IsStored(addr)); i++)
+        {
+            value = i;
+            await(kv.Set, 2, Span(&value, sizeof(value)));
+            dropped = dropped || !IsStored(addr);
+        }
+        AssertEqual(dropped, true);
+        AssertEqual(IsStored(addr), true);
+
+        value = 0;
+        AssertEqual(int(await(kv.Get, 1, Buffer(&value, sizeof(value)))), 0);
+        AssertEqual(int(await(kv.Get, 2, Buffer(&value, sizeof(value)))), 4);
+        AssertEqual(value, int(i - 1));
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("21 Delta Pipe")
+async_test : JournalStorage
+{
+    TestByteStorage store;
+    SimpleVariableJournalFormat format;
+    char block[64];
+    DeltaJournalWriter writer;
+    DeltaJournalReader reader;
+
+    async_test_init(JournalStorage(store, format), store(8192), format(ID("TEST")),
+        writer(*this, 2, block), reader(*this, 2));
+
+    SectorEnumerator se;
+    RecordEnumerator re;
+    SampleChecker checker;
+    io::Pipe pipe;
+    int32_t sample[2];
+
+    int i, calls;
+    size_t n;
+
+    async(Run)
+    async_def()
+    {
+        await(Scan);
+
+        for (i = 0; i < 200; i++)
+        {
+            sample[0] = i;
+            sample[1] = 1000 - 3 * i;
+            await(writer.Write, sample);
+        }
+        await(writer.Flush);
+
+        // a call stops when the pipe runs out of space, the next one continues
+        // with the first sample not written, without repeating or losing any
+        EnumerateSectors(se);
+        for (n = 0, calls = 0; n < 200; calls++)
+        {
+            AssertLessThan(calls, 1000);
+            n += size_t(await(reader.ReadToPipe, se, re, io::PipeWriter(pipe), Timeout::Milliseconds(1)));
+
+            {
+                io::PipeReader pr(pipe);
+                while (pr.Available() >= sizeof(sample))
+                {
+                    for (size_t k = 0; k < sizeof(sample);)
+                    {
+                        Span span = pr.GetSpan().Left(sizeof(sample) - k);
+                        memcpy((uint8_t*)sample + k, span.Pointer(), span.Length());
+                        pr.Advance(span.Length());
+                        k += span.Length();
+                    }
+                    checker.Check(re, sample);
+                }
+                // samples are never split across calls
+                AssertEqual(pr.Available(), size_t(0));
+            }
+        }
+
+        AssertEqual(n, size_t(200));
+        AssertEqual(checker.next, 200);
+        AssertEqual(checker.errors, 0);
+    }
+    async_end
+}
+async_test_end
+
 }
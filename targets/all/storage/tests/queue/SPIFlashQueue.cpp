@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2022 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * storage/tests/queue/SPIFlashQueue.cpp
+ */
+
+#include <testrunner/TestCase.h>
+
+#include <storage/SPIFlashQueue.h>
+#include <storage/TestByteStorage.h>
+
+using namespace storage;
+
+namespace
+{
+
+//! Order in which the queued requests completed
+struct CompletionLog
+{
+    int order[8];
+    int n = 0;
+
+    void Done(int id) { order[n++] = id; }
+};
+
+//! Issues a single request through a queue port from its own task
+struct Client
+{
+    enum Kind { Read, Write, Erase };
+
+    SPIFlashQueue::Port* port;
+    CompletionLog* log;
+    int id;
+    Kind kind;
+    uint32_t addr;
+    uint8_t* data;
+    size_t length;
+    bool started;
+
+    void Start(SPIFlashQueue::Port& port, CompletionLog& log, int id, Kind kind, uint32_t addr, uint8_t* data, size_t length)
+    {
+        this->port = &port;
+        this->log = &log;
+        this->id = id;
+        this->kind = kind;
+        this->addr = addr;
+        this->data = data;
+        this->length = length;
+        started = false;
+        kernel::Task::Run(*this, &Client::Run);
+    }
+
+    async(Run)
+    async_def()
+    {
+        started = true;
+        if (kind == Read)
+        {
+            await(port->Read, addr, Buffer(data, length));
+        }
+        else if (kind == Write)
+        {
+            await(port->Write, addr, Span(data, length));
+        }
+        else
+        {
+            await(port->Erase, addr, length);
+        }
+        log->Done(id);
+    }
+    async_end
+
+    //! Waits until the task has issued its request
+    async(Started)
+    async_def()
+    {
+        while (!started)
+        {
+            async_yield();
+        }
+    }
+    async_end
+};
+
+TEST_CASE("01 Priority")
+async_test : SPIFlashQueue
+{
+    TestByteStorage store;
+    Port lo, hi;
+
+    async_test_init(SPIFlashQueue(store), store(8192), lo(*this, 0), hi(*this, 1));
+
+    CompletionLog log;
+    Client c[4];
+    uint8_t buf[4][1024];
+
+    int cycles;
+
+    async(Run)
+    async_def()
+    {
+        lo.Init();
+        hi.Init();
+
+        // the first read occupies the storage while the others queue up behind it
+        c[0].Start(lo, log, 0, Client::Read, 0, buf[0], 1024);
+        await(c[0].Started);
+        c[1].Start(lo, log, 1, Client::Write, 6144, buf[1], 64);
+        await(c[1].Started);
+        c[2].Start(lo, log, 2, Client::Read, 2048, buf[2], 64);
+        await(c[2].Started);
+        c[3].Start(hi, log, 3, Client::Read, 4096, buf[3], 64);
+        await(c[3].Started);
+
+        cycles = 0;
+        while (log.n < 4)
+        {
+            AssertLessThan(cycles++, 100000);
+            async_yield();
+        }
+
+        // higher priority first, then reads before writes of the same priority
+        AssertEqual(log.order[0], 0);
+        AssertEqual(log.order[1], 3);
+        AssertEqual(log.order[2], 2);
+        AssertEqual(log.order[3], 1);
+        AssertEqual(MergedReads(), uint32_t(0));
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("02 Write Overlay")
+async_test : SPIFlashQueue
+{
+    TestByteStorage store;
+    Port lo, hi;
+
+    async_test_init(SPIFlashQueue(store), store(8192), lo(*this, 0), hi(*this, 1));
+
+    CompletionLog log;
+    Client c[3];
+    uint8_t buf[3][1024], expect[64];
+
+    int cycles;
+
+    async(Run)
+    async_def()
+    {
+        lo.Init();
+        hi.Init();
+
+        // a read overtaking a pending write sees the written data
+        memset(buf[1], 0x5A, 64);
+        c[0].Start(lo, log, 0, Client::Read, 0, buf[0], 1024);
+        await(c[0].Started);
+        c[1].Start(lo, log, 1, Client::Write, 2048 + 32, buf[1], 64);
+        await(c[1].Started);
+        c[2].Start(hi, log, 2, Client::Read, 2048, buf[2], 64);
+        await(c[2].Started);
+
+        cycles = 0;
+        while (log.n < 3)
+        {
+            AssertLessThan(cycles++, 100000);
+            async_yield();
+        }
+
+        AssertEqual(log.order[0], 0);
+        AssertEqual(log.order[1], 2);
+        AssertEqual(log.order[2], 1);
+        memset(expect, 0xFF, 32);
+        memset(expect + 32, 0x5A, 32);
+        AssertEqual(memcmp(buf[2], expect, 64), 0);
+
+        await(lo.Read, 2048, Buffer(buf[2], 64));
+        AssertEqual(memcmp(buf[2], expect, 64), 0);
+
+        // a write never overtakes an older overlapping read
+        log.n = 0;
+        memset(buf[2], 0xA5, 64);
+        c[0].Start(lo, log, 0, Client::Read, 0, buf[0], 1024);
+        await(c[0].Started);
+        c[1].Start(lo, log, 1, Client::Read, 3072, buf[1], 64);
+        await(c[1].Started);
+        c[2].Start(hi, log, 2, Client::Write, 3072, buf[2], 64);
+        await(c[2].Started);
+
+        cycles = 0;
+        while (log.n < 3)
+        {
+            AssertLessThan(cycles++, 100000);
+            async_yield();
+        }
+
+        AssertEqual(log.order[0], 0);
+        AssertEqual(log.order[1], 1);
+        AssertEqual(log.order[2], 2);
+        memset(expect, 0xFF, 64);
+        AssertEqual(memcmp(buf[1], expect, 64), 0);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("03 Merged Reads")
+async_test : SPIFlashQueue
+{
+    TestByteStorage store;
+    Port lo, hi;
+
+    async_test_init(SPIFlashQueue(store), store(8192), lo(*this, 0), hi(*this, 1));
+
+    CompletionLog log;
+    Client c[7];
+    uint8_t buf[7][1024], expect[192];
+
+    int i, cycles;
+
+    async(Run)
+    async_def()
+    {
+        lo.Init();
+        hi.Init();
+
+        for (i = 0; i < 192; i++)
+        {
+            expect[i] = uint8_t(i);
+        }
+        await(hi.Write, 4096, Span(expect, sizeof(expect)));
+        store.ResetStats();
+
+        // adjacent, duplicate and overlapping reads are served by a single burst, the distant one separately
+        c[0].Start(lo, log, 0, Client::Read, 0, buf[0], 1024);
+        await(c[0].Started);
+        c[1].Start(lo, log, 1, Client::Read, 4096 + 128, buf[1], 64);
+        await(c[1].Started);
+        c[2].Start(lo, log, 2, Client::Read, 4096, buf[2], 64);
+        await(c[2].Started);
+        c[3].Start(lo, log, 3, Client::Read, 4096 + 64, buf[3], 64);
+        await(c[3].Started);
+        c[4].Start(lo, log, 4, Client::Read, 6144, buf[4], 64);
+        await(c[4].Started);
+        c[5].Start(lo, log, 5, Client::Read, 4096, buf[5], 64);
+        await(c[5].Started);
+        c[6].Start(lo, log, 6, Client::Read, 4096 + 32, buf[6], 96);
+        await(c[6].Started);
+
+        cycles = 0;
+        while (log.n < 7)
+        {
+            AssertLessThan(cycles++, 100000);
+            async_yield();
+        }
+
+        // the blocking read, the burst and the distant read, each byte of the burst read once
+        AssertEqual(MergedReads(), uint32_t(4));
+        AssertEqual(store.Stats().op[IOStats::Read].count, uint32_t(3));
+        AssertEqual(store.Stats().op[IOStats::Read].bytes, uint32_t(1024 + 192 + 64));
+        AssertEqual(memcmp(buf[2], expect, 64), 0);
+        AssertEqual(memcmp(buf[3], expect + 64, 64), 0);
+        AssertEqual(memcmp(buf[1], expect + 128, 64), 0);
+        AssertEqual(memcmp(buf[5], expect, 64), 0);
+        AssertEqual(memcmp(buf[6], expect + 32, 96), 0);
+    }
+    async_end
+}
+async_test_end
+
+TEST_CASE("04 Ordered Operations")
+async_test : SPIFlashQueue
+{
+    TestByteStorage store;
+    Port lo, hi;
+
+    async_test_init(SPIFlashQueue(store), store(8192), lo(*this, 0), hi(*this, 1));
+
+    CompletionLog log;
+    Client c[4];
+    uint8_t buf[4][1024], expect[64];
+
+    int cycles;
+
+    async(Run)
+    async_def()
+    {
+        lo.Init();
+        hi.Init();
+
+        memset(expect, 0, sizeof(expect));
+        await(hi.Write, 1024, Span(expect, sizeof(expect)));
+
+        // higher priority requests cannot overtake a pending erase
+        memset(buf[3], 0, 16);
+        c[0].Start(lo, log, 0, Client::Read, 6144, buf[0], 1024);
+        await(c[0].Started);
+        c[1].Start(lo, log, 1, Client::Erase, 1024, NULL, 1024);
+        await(c[1].Started);
+        c[2].Start(hi, log, 2, Client::Read, 1024, buf[2], 64);
+        await(c[2].Started);
+        c[3].Start(hi, log, 3, Client::Write, 1024 + 512, buf[3], 16);
+        await(c[3].Started);
+
+        cycles = 0;
+        while (log.n < 4)
+        {
+            AssertLessThan(cycles++, 100000);
+            async_yield();
+        }
+
+        AssertEqual(log.order[0], 0);
+        AssertEqual(log.order[1], 1);
+        AssertEqual(log.order[2], 2);
+        AssertEqual(log.order[3], 3);
+        memset(expect, 0xFF, sizeof(expect));
+        AssertEqual(memcmp(buf[2], expect, 64), 0);
+
+        await(lo.Read, 1024 + 512, Buffer(buf[2], 16));
+        AssertEqual(memcmp(buf[2], buf[3], 16), 0);
+    }
+    async_end
+}
+async_test_end
+
+}
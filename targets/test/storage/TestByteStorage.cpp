@@ -39,12 +39,14 @@ TestByteStorage::~TestByteStorage()
     delete[] data;
 }
 
-async(TestByteStorage::Wait, int min, int max)
+async(TestByteStorage::Wait, IOStats::Op op, int min, int max)
 async_def(
     int n;
 )
 {
-    f.n = min + rand() % (max - min + 1);
+    f.n = min + Random() % (max - min + 1);
+    stats.busyTime += f.n;
+    stats.Latency(op, f.n);
     while (f.n-- > 0)
     {
         async_yield();
@@ -59,10 +61,11 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
 
     while (f.read < length)
     {
-        await(Wait, tRmin, tRmax);
+        await(Wait, IOStats::Read, tRmin, tRmax);
         size_t blk = std::min(length - f.read, pageSize);
         memcpy((uint8_t*)buffer + f.read, data + addr, blk);
         f.read += blk;
@@ -79,10 +82,11 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, length);
 
     while (f.read < length)
     {
-        await(Wait, tRmin, tRmax);
+        await(Wait, IOStats::Read, tRmin, tRmax);
         size_t blk = std::min(length - f.read, pageSize);
         while (blk--)
         {
@@ -101,20 +105,23 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Read, 0);
 
     while (f.read < length)
     {
-        if (!pipe.Available() && !await(pipe.Allocate, length - f.read, timeout))
+        if (!pipeBudget || (!pipe.Available() && !await(pipe.Allocate, length - f.read, timeout)))
         {
             break;
         }
 
-        await(Wait, tRmin, tRmax);
+        await(Wait, IOStats::Read, tRmin, tRmax);
 
-        auto buf = pipe.GetBuffer().Left(pageSize).Left(length - f.read);
+        auto buf = pipe.GetBuffer().Left(pageSize).Left(length - f.read).Left(pipeBudget);
         memcpy(buf.Pointer(), data + addr + f.read, buf.Length());
         pipe.Advance(buf.Length());
         f.read += buf.Length();
+        pipeBudget -= buf.Length();
+        stats.op[IOStats::Read].bytes += buf.Length();
 
         MYDIAG(DIAG_READ, "%X==%H", addr, buf);
     }
@@ -130,12 +137,13 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
 
     while (f.written < length)
     {
         f.len = std::min(PageRemaining(addr + f.written), length - f.written);
 
-        await(Wait, tWmin, tWmax);
+        await(Wait, IOStats::Write, tWmin, tWmax);
         auto pd = data + addr + f.written;
         auto ps = (const uint8_t*)buffer + f.written;
         MYDIAG(DIAG_WRITE, "%X=%H", addr + f.written, Span(ps, f.len));
@@ -173,6 +181,90 @@ async_def(
 }
 async_end
 
+async(TestByteStorage::ReadV, const ReadSegment* segments, size_t count)
+async_def(
+    size_t i, n, k, read, length;
+)
+{
+    while (f.i < count)
+    {
+        // collect a run of adjacent segments
+        f.length = 0;
+        for (f.n = 0; f.i + f.n < count; f.n++)
+        {
+            auto& seg = segments[f.i + f.n];
+            if (seg.addr != segments[f.i].addr + f.length)
+            {
+                break;
+            }
+            ASSERT(seg.addr + seg.data.Length() <= Size());
+            f.length += seg.data.Length();
+        }
+
+        stats.Count(IOStats::Read, f.length);
+        for (f.read = 0; f.read < f.length; f.read += pageSize)
+        {
+            await(Wait, IOStats::Read, tRmin, tRmax);
+        }
+        for (f.k = 0; f.k < f.n; f.k++)
+        {
+            auto& seg = segments[f.i + f.k];
+            memcpy(seg.data.Pointer(), data + seg.addr, seg.data.Length());
+            MYDIAG(DIAG_READ, "%X==%H", seg.addr, seg.data);
+        }
+        f.i += f.n;
+    }
+}
+async_end
+
+async(TestByteStorage::WriteV, const WriteSegment* segments, size_t count)
+async_def(
+    size_t i, n;
+)
+{
+    while (f.i < count)
+    {
+        {
+            // collect a run of ascending segments within a single page
+            uint32_t start = segments[f.i].addr, end = start;
+            for (f.n = 0; f.i + f.n < count; f.n++)
+            {
+                auto& seg = segments[f.i + f.n];
+                if (seg.addr < end || (start ^ (seg.addr + seg.data.Length() - 1)) & ~pageMask)
+                {
+                    break;
+                }
+                end = seg.addr + seg.data.Length();
+            }
+        }
+
+        if (f.n < 2)
+        {
+            await(Write, segments[f.i].addr, segments[f.i].data);
+            f.i++;
+            continue;
+        }
+
+        stats.Count(IOStats::Write, 0);
+        await(Wait, IOStats::Write, tWmin, tWmax);
+        for (size_t k = 0; k < f.n; k++)
+        {
+            auto& seg = segments[f.i + k];
+            ASSERT(seg.addr + seg.data.Length() <= Size());
+            MYDIAG(DIAG_WRITE, "%X=%H", seg.addr, seg.data);
+            auto pd = data + seg.addr;
+            auto ps = (const uint8_t*)seg.data.Pointer();
+            for (size_t j = 0; j < seg.data.Length(); j++)
+            {
+                *pd++ &= *ps++;
+            }
+            stats.op[IOStats::Write].bytes += seg.data.Length();
+        }
+        f.i += f.n;
+    }
+}
+async_end
+
 async(TestByteStorage::Fill, uint32_t addr, uint8_t value, size_t length)
 async_def(
     size_t written, len;
@@ -180,13 +272,14 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Write, length);
 
     while (f.written < length)
     {
         f.len = std::min(PageRemaining(addr + f.written), length - f.written);
         MYDIAG(DIAG_WRITE, "%X=%d*%02X", addr + f.written, f.len, value);
 
-        await(Wait, tWmin, tWmax);
+        await(Wait, IOStats::Write, tWmin, tWmax);
         auto pd = data + addr + f.written;
         for (size_t i = 0; i < f.len; i++)
         {
@@ -204,6 +297,7 @@ async_def(
 {
     ASSERT(addr <= Size());
     ASSERT(addr + length <= Size());
+    stats.Count(IOStats::Check, 0);
 
     if (!length)
     {
@@ -212,8 +306,9 @@ async_def(
 
     while (f.checked < length)
     {
-        await(Wait, tRmin, tRmax);
+        await(Wait, IOStats::Check, tRmin, tRmax);
         size_t blk = std::min(length - f.checked, pageSize);
+        stats.op[IOStats::Check].bytes += blk;
         for (size_t i = 0; i < blk; i++)
         {
             if (data[addr + f.checked + i] != value)
@@ -282,7 +377,8 @@ async_def(
 
         MYDBG("erasing %d KB block starting at %X", SectorSize(), f.start);
         MYDIAG(DIAG_WRITE, "%X...", f.start);
-        await(Wait, tEPmin, tEPmax);
+        stats.Count(IOStats::Erase, SectorSize());
+        await(Wait, IOStats::Erase, tEPmin, tEPmax);
         memset(data + f.start, 0xFF, SectorSize());
         async_return(f.end);
     }
@@ -27,15 +27,30 @@ public:
     int tEPmin = 100, tEPmax = 200; //< min/max page erase cycles
 
     TestByteStorage& MakeSync() { tRmin = tRmax = tWmin = tWmax = tEPmin = tEPmax = 0; return *this; }
+    //! Seeds the generator of simulated timings, making runs repeatable
+    TestByteStorage& Seed(uint32_t seed) { rng = nonzero(seed, 1u); return *this; }
+    //! Makes the storage directly readable using @ref GetDirectPointer, like a memory-mapped medium
+    TestByteStorage& MakeMapped() { mapped = true; return *this; }
+    //! Makes @ref ReadToPipe stop after the specified number of bytes, as if the pipe timed out
+    TestByteStorage& StallPipe(size_t bytes) { pipeBudget = bytes; return *this; }
+
+    const void* GetDirectPointer(uint32_t addr, size_t length) final override
+        { return mapped && addr <= Size() && addr + length <= Size() ? data + addr : NULL; }
+
 
 private:
     uint8_t* data;
+    uint32_t rng = 1;
+    bool mapped = false;
+    size_t pipeBudget = ~size_t(0);
     static constexpr size_t pageSize = 256, pageMask = 255;
 
     async(ReadImpl, uint32_t addr, void* buffer, size_t length) final override;
     async(WriteImpl, uint32_t addr, const void* buffer, size_t length) final override;
 
-    async(Wait, int tMin, int tMax);
+    async(Wait, IOStats::Op op, int tMin, int tMax);
+    //! xorshift32 generator, fully determined by the seed
+    uint32_t Random() { rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5; return rng; }
 
     size_t PageRemaining(uint32_t addr) { return (~addr & 0xFF) + 1; }
 
@@ -44,6 +59,10 @@ public:
     async(ReadToPipe, io::PipeWriter pipe, uint32_t addr, size_t length, Timeout timeout) final override;
 
     async(WriteFromPipe, io::PipeReader pipe, uint32_t addr, size_t length, Timeout timeout) final override;
+    //! Reads runs of adjacent segments as a single operation, like @ref SPIFlash::ReadV
+    async(ReadV, const ReadSegment* segments, size_t count) final override;
+    //! Programs runs of ascending segments within the same page as a single operation, like @ref SPIFlash::WriteV
+    async(WriteV, const WriteSegment* segments, size_t count) final override;
     async(Fill, uint32_t addr, uint8_t value, size_t length) final override;
 
     async(IsAll, uint32_t addr, uint8_t value, size_t length) final override;